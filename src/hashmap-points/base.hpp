@@ -12,28 +12,124 @@
 #ifndef BASE_H_
 #define BASE_H_
 
+#include <algorithm>
+#include <string>
 #include "atto/opencl/opencl.hpp"
 
 namespace Params {
-/* Model parameters */
+/* Model parameters, set at startup from the command line or a config file */
+extern cl_uint n_points;
+extern cl_uint n_cells;
+extern cl_uint load_factor;
+extern cl_float3 domain_lo;
+extern cl_float3 domain_hi;
+extern std::string points_file;                 /* binary or PLY, empty for random points */
+extern cl_uint seed;                            /* random points generator key */
+
+/* Dynamics parameters, soft spheres of unit mass, set at startup */
+extern cl_float time_step;
+extern cl_float stiffness;
+extern cl_float diameter;                       /* not above the cell width */
+
+/* Surface parameters, set at startup */
+extern cl_uint surface_grid;                    /* grid nodes per axis, 0 disables */
+extern cl_float surface_radius;                 /* not above the cell width */
+extern cl_float surface_iso;                    /* density iso-value */
+
+/* Neighbor list parameters, set at startup */
+extern cl_float neighbor_cutoff;                /* not below the diameter, 0 disables the lists */
+extern cl_float neighbor_skin;                  /* cutoff plus skin not above the cell width */
+
+/* Model constants */
 static const cl_uint empty_state = 0xffffffff;
-static const cl_uint n_points = 16384;
-static const cl_uint n_cells = 5;
-static const cl_uint load_factor = 4;
-static const cl_uint capacity = load_factor * n_points;
+static const cl_uint max_cells = 1 << 21;     /* Morton key limit */
+static const cl_uint max_surface_grid = 256;
+static const cl_uint reorder_interval = 16;     /* 0 disables reordering */
+static const size_t load_chunk = 1 << 20;       /* points per streamed write */
+
+/* Diagnostics parameters */
+static const bool diagnostics = false;
+static const cl_uint probe_bins = 16;           /* kProbeBins in the kernels */
+static const cl_uint n_readbacks = 2;
 
-static const cl_float3 domain_lo = {-1.0f, -1.0f, -1.0f};
-static const cl_float3 domain_hi = { 1.0f,  1.0f,  1.0f};
+/* Trajectory parameters */
+static const cl_uint n_snapshots = 3;           /* pinned snapshots in flight */
+
+/* Neighbor list parameters */
+static const cl_uint neighbor_capacity = 32;    /* mean neighbors per point */
+static const cl_uint neighbor_samples = 1024;   /* points cross-checked on the host */
+
+/* Query parameters */
+static const cl_uint max_probes = 4096;
+static const cl_float probe_radius = 0.4f;
 
 /* OpenGL parameters */
+static const cl_uint max_pipeline_depth = 4;
+static const bool frustum_culling = true;       /* with OpenGL sharing */
+static const cl_float cull_margin = 0.1f;       /* camera motion between frames */
 static const int window_width = 1024;
 static const int window_height = 1024;
 static const char window_title[] = "hashmap-points";
 static const double poll_timeout = 0.01;
 
+/* Profiling parameters, always enabled in headless runs */
+static const bool profiling = false;
+static const size_t profile_samples = 1024;
+static const size_t profile_interval = 300;
+
+/* Headless benchmark parameters */
+static const size_t benchmark_frames = 1000;
+static const float frame_time = 1.0f / 60.0f;
+
 /* OpenCL parameters */
-static const cl_ulong device_index = 2;
-static const cl_ulong work_group_size = 256;
+static const char program_cache[] = "data/cache";   /* binaries, empty disables */
+
+/* OpenCL parameters, set at startup */
+extern cl_ulong work_group_size;
+
+/* OpenGL parameters, set at startup */
+extern cl_uint pipeline_depth;                  /* vertex buffer sets, 1 serializes */
+
+/* Backend parameters, set at startup */
+extern bool cpu_backend;                        /* run on the host, "backend cpu" */
+extern cl_uint check_interval;                  /* cross-check the device, 0 disables */
+
+/* Trajectory parameters, set at startup */
+extern std::string trajectory_file;             /* empty disables */
+extern cl_uint trajectory_interval;             /* frames between snapshots */
+extern bool trajectory_quantize;                /* unorm16 xyz, "trajectory_format unorm16" */
+
+/* Derived parameters, computed by Params::update:
+ *  capacity    hashmap capacity, the smallest power of two not less than
+ *              load_factor * n_points
+ *  max_hits    query CSR indices capacity
+ *  n_sort      sort size, the smallest power of two not less than n_points
+ *              and not less than the work-group size
+ *  n_voxels    surface grid size, surface_grid^3
+ *  max_vertices surface vertex capacity, one triangle per voxel
+ *  max_neighbors neighbor list indices capacity */
+extern cl_uint capacity;
+extern cl_uint max_hits;
+extern cl_uint n_sort;
+extern cl_uint n_voxels;
+extern cl_uint max_vertices;
+extern cl_uint max_neighbors;
+
+constexpr cl_uint next_pow2(cl_uint n) { return n <= 1 ? 1 : 2 * next_pow2((n + 1) / 2); }
+
+/* Set a parameter from its name and value string, return false if the name
+ * is unknown. Vector values are comma separated. */
+bool set(const std::string &name, const std::string &value);
+
+/* Set the parameters in a config file, one "name = value" per line, with
+ * comments starting with #. */
+void load(const std::string &filename);
+
+/* Check the parameters and compute the derived parameters. */
+void update(void);
+
+/* Program build options defining the parameters as kernel constants. */
+std::string build_options(void);
 } /* Params */
 
 #endif /* BASE_H_ */
@@ -19,13 +19,14 @@ using namespace atto;
  */
 void Camera::update(void)
 {
-    /* Compute camera front and right direction vectors. */
+    /* Compute camera front, right and up direction vectors, the view basis. */
     m_front = math::vec3f{
         std::cos(m_pitch) * std::cos(m_yaw),
         std::sin(m_pitch),
         std::cos(m_pitch) * std::sin(m_yaw)};
     m_front = math::normalize(m_front);
     m_right = math::normalize(math::cross(m_front, m_up));
+    m_view_up = math::cross(m_right, m_front);
 
     /* Compute camera transforms. */
     m_view = math::lookat(m_eye, m_eye + m_front, m_up);
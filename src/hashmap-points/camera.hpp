@@ -24,6 +24,7 @@ struct Camera {
     atto::math::vec3f m_up;
     atto::math::vec3f m_front;
     atto::math::vec3f m_right;
+    atto::math::vec3f m_view_up;
 
     /* Camera projection parameters. */
     float m_fovy;
@@ -40,6 +41,7 @@ struct Camera {
     const atto::math::vec3f &up(void) const { return m_up; }
     const atto::math::vec3f &front(void) const { return m_front; }
     const atto::math::vec3f &right(void) const { return m_right; }
+    const atto::math::vec3f &view_up(void) const { return m_view_up; }
 
     const float &fovy(void) const { return m_fovy; }
     const float &aspect(void) const { return m_aspect; }
@@ -93,6 +95,7 @@ struct Camera {
         m_up    = other.m_up;
         m_front = other.m_front;
         m_right = other.m_right;
+        m_view_up = other.m_view_up;
 
         /* Camera lens parameters */
         m_fovy   = other.m_fovy;
@@ -116,6 +119,7 @@ struct Camera {
         m_up    = other.m_up;
         m_front = other.m_front;
         m_right = other.m_right;
+        m_view_up = other.m_view_up;
 
         /* Camera lens parameters */
         m_fovy   = other.m_fovy;
@@ -0,0 +1,624 @@
+/*
+ * cpu.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <omp.h>
+#include <algorithm>
+#include <cmath>
+#include "cpu.hpp"
+using namespace atto;
+
+static const cl_uint kEmpty = 0xffffffff;
+static const cl_ulong kEmptyKey = 0xffffffffffffffffUL;
+static const cl_uchar kRadiusLarge = 255;       /* 1.0 in unorm8 */
+static const cl_uchar kRadiusSmall = 26;        /* 0.1 in unorm8 */
+static const cl_uint kBatch = 16;               /* SIMD distance test batch */
+
+/** ---------------------------------------------------------------------------
+ * hash
+ * Hashmap hash function, the 64-bit finalizer of MurmurHash3.
+ */
+static inline cl_ulong hash(const cl_ulong key)
+{
+    cl_ulong h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
+
+/** ---------------------------------------------------------------------------
+ * philox4x32
+ * Counter-based random number generator Philox4x32-10, as in the kernels.
+ */
+static inline void philox4x32(cl_uint ctr[4], cl_uint key[2])
+{
+    for (cl_uint round = 0; round < 10; ++round) {
+        const cl_ulong p0 = (cl_ulong) 0xD2511F53 * ctr[0];
+        const cl_ulong p1 = (cl_ulong) 0xCD9E8D57 * ctr[2];
+        const cl_uint c1 = ctr[1];
+        ctr[0] = (cl_uint) (p1 >> 32) ^ c1 ^ key[0];
+        ctr[1] = (cl_uint) p1;
+        ctr[2] = (cl_uint) (p0 >> 32) ^ ctr[3] ^ key[1];
+        ctr[3] = (cl_uint) p0;
+        key[0] += 0x9E3779B9;
+        key[1] += 0xBB67AE85;
+    }
+}
+
+/**
+ * morton_spread
+ * Spread the lower 21 bits of v so that there are two zero bits between
+ * each pair of consecutive bits.
+ */
+static inline cl_ulong morton_spread(const cl_uint v)
+{
+    cl_ulong x = v & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffUL;
+    x = (x | x << 16) & 0x1f0000ff0000ffUL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fUL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3UL;
+    x = (x | x << 2)  & 0x1249249249249249UL;
+    return x;
+}
+
+/**
+ * cell_key
+ * Compute the cell key, the Morton code of the cell index coordinates.
+ */
+static inline cl_ulong cell_key(const cl_uint x, const cl_uint y, const cl_uint z)
+{
+    return morton_spread(x) | (morton_spread(y) << 1) | (morton_spread(z) << 2);
+}
+
+/**
+ * keyvalue_less
+ * Order KeyValue pairs by key and then by value.
+ */
+static inline bool keyvalue_less(const Model::KeyValue &a, const Model::KeyValue &b)
+{
+    return (a.key < b.key) || (a.key == b.key && a.value < b.value);
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::cell_keys
+ * @brief Compute the (cell key, point id) pair of each point, with the cell
+ * index clamped to the domain grid as in the cell_keys kernel.
+ */
+void CpuBackend::cell_keys(const std::vector<cl_float> &pos)
+{
+    const cl_uint n_points = Params::n_points;
+    const cl_float n_cells = (cl_float) Params::n_cells;
+    const cl_float max_cell = (cl_float) (Params::n_cells - 1);
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+
+    m_keys.resize(n_points);
+    Model::KeyValue *keys = m_keys.data();
+    const cl_float *p = pos.data();
+
+    #pragma omp parallel for simd
+    for (cl_uint i = 0; i < n_points; ++i) {
+        cl_uint cell[3];
+        for (size_t k = 0; k < 3; ++k) {
+            cl_float u = n_cells * ((p[3*i + k] - lo.s[k]) / (hi.s[k] - lo.s[k]));
+            cell[k] = (cl_uint) std::min(std::max(u, 0.0f), max_cell);
+        }
+        keys[i].key = cell_key(cell[0], cell[1], cell[2]);
+        keys[i].value = i;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::sort
+ * @brief Sort the cell list. Each thread sorts a chunk, then pairs of sorted
+ * chunks are merged in parallel until a single run is left.
+ */
+void CpuBackend::sort(void)
+{
+    const size_t n = m_keys.size();
+    const size_t n_chunks = std::max(1, omp_get_max_threads());
+    m_keys_swap.resize(n);
+
+    std::vector<size_t> bounds(n_chunks + 1);
+    for (size_t c = 0; c <= n_chunks; ++c) {
+        bounds[c] = n * c / n_chunks;
+    }
+
+    #pragma omp parallel for
+    for (size_t c = 0; c < n_chunks; ++c) {
+        std::sort(
+            m_keys.begin() + bounds[c],
+            m_keys.begin() + bounds[c + 1],
+            keyvalue_less);
+    }
+
+    for (size_t width = 1; width < n_chunks; width *= 2) {
+        #pragma omp parallel for
+        for (size_t c = 0; c < n_chunks; c += 2 * width) {
+            size_t lo = bounds[c];
+            size_t mid = bounds[std::min(c + width, n_chunks)];
+            size_t hi = bounds[std::min(c + 2 * width, n_chunks)];
+            std::merge(
+                m_keys.begin() + lo, m_keys.begin() + mid,
+                m_keys.begin() + mid, m_keys.begin() + hi,
+                m_keys_swap.begin() + lo,
+                keyvalue_less);
+        }
+        std::swap(m_keys, m_keys_swap);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::hashmap_clear
+ * @brief Clear the hashmap.
+ */
+void CpuBackend::hashmap_clear(void)
+{
+    const cl_uint capacity = Params::capacity;
+    m_hashmap.resize(capacity);
+    Model::Cell *hashmap = m_hashmap.data();
+
+    #pragma omp parallel for
+    for (cl_uint i = 0; i < capacity; ++i) {
+        hashmap[i].key = kEmptyKey;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::hashmap_build
+ * @brief Insert the cells of the sorted cell list into the hashmap. Hash the
+ * keys in a vectorized batch, then insert each run of equal keys from its
+ * first pair, claiming a slot by a compare-and-swap of the slot key.
+ */
+void CpuBackend::hashmap_build(void)
+{
+    const cl_uint n_points = Params::n_points;
+    const cl_ulong mask = Params::capacity - 1;
+    const Model::KeyValue *keys = m_keys.data();
+    Model::Cell *hashmap = m_hashmap.data();
+
+    /* Home slot of every key. */
+    m_slots.resize(n_points);
+    cl_uint *slots = m_slots.data();
+
+    #pragma omp parallel for simd
+    for (cl_uint i = 0; i < n_points; ++i) {
+        slots[i] = (cl_uint) (hash(keys[i].key) & mask);
+    }
+
+    /* Insert the runs of equal keys. */
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (cl_uint i = 0; i < n_points; ++i) {
+        const cl_ulong key = keys[i].key;
+        if (i > 0 && keys[i - 1].key == key) {
+            continue;
+        }
+
+        cl_uint end = i + 1;
+        while (end < n_points && keys[end].key == key) {
+            end++;
+        }
+
+        cl_uint slot = slots[i];
+        while (true) {
+            cl_ulong expected = kEmptyKey;
+            if (__atomic_compare_exchange_n(
+                    &hashmap[slot].key, &expected, key,
+                    false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                hashmap[slot].start = i;
+                hashmap[slot].end = end;
+                break;
+            }
+            slot = (slot + 1) & mask;
+        }
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::reorder_points
+ * @brief Gather the point arrays in the order of the sorted cell list and
+ * reset the point ids of the cell list to the new storage order.
+ */
+void CpuBackend::reorder_points(
+    std::vector<cl_float> &pos,
+    std::vector<cl_uchar4> &col,
+    std::vector<cl_uchar> &radius,
+    std::vector<cl_float> &vel)
+{
+    const cl_uint n_points = Params::n_points;
+    std::vector<cl_float> pos_out(pos.size());
+    std::vector<cl_uchar4> col_out(col.size());
+    std::vector<cl_uchar> radius_out(radius.size());
+    std::vector<cl_float> vel_out(vel.size());
+
+    #pragma omp parallel for
+    for (cl_uint i = 0; i < n_points; ++i) {
+        const cl_uint src = m_keys[i].value;
+        for (size_t k = 0; k < 3; ++k) {
+            pos_out[3*i + k] = pos[3*src + k];
+            vel_out[3*i + k] = vel[3*src + k];
+        }
+        col_out[i] = col[src];
+        radius_out[i] = radius[src];
+        m_keys[i].value = i;
+    }
+
+    pos.swap(pos_out);
+    col.swap(col_out);
+    radius.swap(radius_out);
+    vel.swap(vel_out);
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::hashmap_find
+ * @brief Linearly probe the hashmap for the slot holding the key. Return
+ * kEmpty if the key is not in the hashmap.
+ */
+cl_uint CpuBackend::hashmap_find(const cl_ulong key) const
+{
+    const cl_ulong mask = Params::capacity - 1;
+    cl_uint slot = (cl_uint) (hash(key) & mask);
+    for (cl_uint i = 0; i < Params::capacity; ++i) {
+        cl_ulong slot_key = m_hashmap[slot].key;
+        if (slot_key == key) {
+            return slot;
+        }
+        if (slot_key == kEmptyKey) {
+            return kEmpty;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return kEmpty;
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::query_probe
+ * @brief Visit the cells overlapping the probe sphere, with periodic boundary
+ * conditions, and count the points within the probe radius. Test distances
+ * in SIMD batches of kBatch points. If indices is not null, store the point
+ * ids starting at offset, up to max_hits.
+ */
+cl_uint CpuBackend::query_probe(
+    const Model::Probe &probe,
+    const std::vector<cl_float> &pos,
+    cl_uint *indices,
+    const cl_uint offset) const
+{
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+    const cl_float radius_sq = probe.radius * probe.radius;
+    const cl_float *p = pos.data();
+
+    cl_float length[3];
+    cl_float width[3];
+    for (size_t k = 0; k < 3; ++k) {
+        length[k] = hi.s[k] - lo.s[k];
+        width[k] = length[k] / (cl_float) Params::n_cells;
+    }
+
+    /* Range of cells overlapping the probe, at most n_cells along each axis */
+    const int n = (int) Params::n_cells;
+    int c_lo[3];
+    int c_hi[3];
+    for (size_t k = 0; k < 3; ++k) {
+        c_lo[k] = (int) std::floor((probe.pos.s[k] - probe.radius - lo.s[k]) / width[k]);
+        c_hi[k] = (int) std::floor((probe.pos.s[k] + probe.radius - lo.s[k]) / width[k]);
+        if (c_hi[k] - c_lo[k] >= n) {
+            c_hi[k] = c_lo[k] + n - 1;
+        }
+    }
+
+    cl_uint count = 0;
+    for (int z = c_lo[2]; z <= c_hi[2]; ++z) {
+        for (int y = c_lo[1]; y <= c_hi[1]; ++y) {
+            for (int x = c_lo[0]; x <= c_hi[0]; ++x) {
+                const int c[3] = {x, y, z};
+                cl_uint cell[3];
+                for (size_t k = 0; k < 3; ++k) {
+                    cell[k] = (cl_uint) (((c[k] % n) + n) % n);
+                }
+
+                cl_uint slot = hashmap_find(cell_key(cell[0], cell[1], cell[2]));
+                if (slot == kEmpty) {
+                    continue;
+                }
+                const cl_uint start = m_hashmap[slot].start;
+                const cl_uint end = m_hashmap[slot].end;
+
+                /* Every point in a cell inside the probe sphere is a hit. */
+                cl_float far_sq = 0.0f;
+                for (size_t k = 0; k < 3; ++k) {
+                    cl_float cell_lo = lo.s[k] + width[k] * (cl_float) c[k];
+                    cl_float far = std::max(
+                        std::fabs(probe.pos.s[k] - cell_lo),
+                        std::fabs(probe.pos.s[k] - (cell_lo + width[k])));
+                    far_sq += far * far;
+                }
+                if (far_sq <= radius_sq) {
+                    for (cl_uint i = start; indices && i < end; ++i) {
+                        cl_uint hit = offset + count + (i - start);
+                        if (hit < Params::max_hits) {
+                            indices[hit] = m_keys[i].value;
+                        }
+                    }
+                    count += end - start;
+                    continue;
+                }
+
+                /* Test the distances of a batch, then compact the hits. */
+                for (cl_uint base = start; base < end; base += kBatch) {
+                    const cl_uint m = std::min(kBatch, end - base);
+                    cl_uint ids[kBatch];
+                    cl_float dist_sq[kBatch];
+
+                    #pragma omp simd
+                    for (cl_uint j = 0; j < m; ++j) {
+                        const cl_uint id = m_keys[base + j].value;
+                        cl_float d_sq = 0.0f;
+                        for (size_t k = 0; k < 3; ++k) {
+                            cl_float d = p[3*id + k] - probe.pos.s[k];
+                            d -= length[k] * std::rint(d / length[k]);  /* minimum image */
+                            d_sq += d * d;
+                        }
+                        ids[j] = id;
+                        dist_sq[j] = d_sq;
+                    }
+
+                    for (cl_uint j = 0; j < m; ++j) {
+                        if (dist_sq[j] > radius_sq) {
+                            continue;
+                        }
+                        if (indices && offset + count < Params::max_hits) {
+                            indices[offset + count] = ids[j];
+                        }
+                        count++;
+                    }
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::query
+ * @brief Batched radius query, as in Model::query. Count the hits of each
+ * probe, scan the counts into the CSR offsets and store the point ids in the
+ * CSR indices, with the total number of hits in offsets[n_probes]. Sum the
+ * weights (1 - r^2/R^2)^2 of the stored hits of each probe into its density,
+ * as in the query_weights and segment_sum kernels.
+ */
+void CpuBackend::query(
+    const std::vector<cl_float> &pos,
+    const Model::Probe *probes,
+    const cl_uint n_probes)
+{
+    m_query_size = n_probes;
+    m_offsets.assign(n_probes + 1, 0);
+    m_indices.resize(Params::max_hits);
+
+    #pragma omp parallel for schedule(dynamic)
+    for (cl_uint i = 0; i < n_probes; ++i) {
+        m_offsets[i + 1] = query_probe(probes[i], pos, NULL, 0);
+    }
+
+    for (cl_uint i = 0; i < n_probes; ++i) {
+        m_offsets[i + 1] += m_offsets[i];
+    }
+
+    #pragma omp parallel for schedule(dynamic)
+    for (cl_uint i = 0; i < n_probes; ++i) {
+        query_probe(probes[i], pos, m_indices.data(), m_offsets[i]);
+    }
+
+    cl_float length[3];
+    for (size_t k = 0; k < 3; ++k) {
+        length[k] = Params::domain_hi.s[k] - Params::domain_lo.s[k];
+    }
+
+    m_density.assign(n_probes, 0.0f);
+    #pragma omp parallel for schedule(dynamic)
+    for (cl_uint i = 0; i < n_probes; ++i) {
+        const cl_float radius_sq = probes[i].radius * probes[i].radius;
+        const cl_uint end = std::min(m_offsets[i + 1], Params::max_hits);
+        cl_float sum = 0.0f;
+        for (cl_uint j = m_offsets[i]; j < end; ++j) {
+            const cl_uint id = m_indices[j];
+            cl_float d_sq = 0.0f;
+            for (size_t k = 0; k < 3; ++k) {
+                cl_float d = pos[3*id + k] - probes[i].pos.s[k];
+                d -= length[k] * std::rint(d / length[k]);  /* minimum image */
+                d_sq += d * d;
+            }
+            cl_float w = std::max(1.0f - d_sq / radius_sq, 0.0f);
+            sum += w * w;
+        }
+        m_density[i] = sum;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::query_mark
+ * @brief Color the points found by the last query if mark is set, otherwise
+ * reset their color.
+ */
+void CpuBackend::query_mark(
+    std::vector<cl_uchar4> &col,
+    std::vector<cl_uchar> &radius,
+    const std::vector<cl_float> &pos,
+    const cl_uint mark)
+{
+    if (m_query_size == 0) {
+        return;
+    }
+
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+    const cl_uint n_hits = std::min(m_offsets[m_query_size], Params::max_hits);
+
+    #pragma omp parallel for
+    for (cl_uint i = 0; i < n_hits; ++i) {
+        const cl_uint id = m_indices[i];
+        if (mark) {
+            for (size_t k = 0; k < 3; ++k) {
+                cl_float u = (pos[3*id + k] - lo.s[k]) / (hi.s[k] - lo.s[k]);
+                col[id].s[k] = (cl_uchar) std::rint(std::min(std::max(u * 255.0f, 0.0f), 255.0f));
+            }
+            col[id].s[3] = 255;
+            radius[id] = kRadiusLarge;
+        } else {
+            col[id] = cl_uchar4{{255, 255, 255, 255}};
+            radius[id] = kRadiusSmall;
+        }
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::compute_forces
+ * @brief Soft-sphere repulsion with the neighbors found in the 27 cells
+ * around each point, integrating the velocities over a time step, as in the
+ * compute_forces kernel.
+ */
+void CpuBackend::compute_forces(
+    std::vector<cl_float> &vel,
+    const std::vector<cl_float> &pos)
+{
+    const cl_uint n_points = Params::n_points;
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+    const cl_float diameter = Params::diameter;
+    const cl_float stiffness = Params::stiffness;
+    const int n = (int) Params::n_cells;
+    const cl_float *p = pos.data();
+
+    cl_float length[3];
+    for (size_t k = 0; k < 3; ++k) {
+        length[k] = hi.s[k] - lo.s[k];
+    }
+
+    #pragma omp parallel for schedule(dynamic, 256)
+    for (cl_uint id = 0; id < n_points; ++id) {
+        int c[3];
+        for (size_t k = 0; k < 3; ++k) {
+            cl_float u = (cl_float) n * ((p[3*id + k] - lo.s[k]) / length[k]);
+            c[k] = (int) std::min(std::max(u, 0.0f), (cl_float) (n - 1));
+        }
+
+        /* The force components are scalars, so the simd loop reduces them. */
+        cl_float fx = 0.0f, fy = 0.0f, fz = 0.0f;
+        for (int z = -1; z <= 1; ++z) {
+            for (int y = -1; y <= 1; ++y) {
+                for (int x = -1; x <= 1; ++x) {
+                    const int offset[3] = {x, y, z};
+                    cl_uint cell[3];
+                    for (size_t k = 0; k < 3; ++k) {
+                        cell[k] = (cl_uint) (((c[k] + offset[k]) % n + n) % n);
+                    }
+
+                    cl_uint slot = hashmap_find(cell_key(cell[0], cell[1], cell[2]));
+                    if (slot == kEmpty) {
+                        continue;
+                    }
+
+                    const cl_uint start = m_hashmap[slot].start;
+                    const cl_uint end = m_hashmap[slot].end;
+                    #pragma omp simd reduction(+:fx,fy,fz)
+                    for (cl_uint i = start; i < end; ++i) {
+                        const cl_uint other = m_keys[i].value;
+                        cl_float dx = p[3*id + 0] - p[3*other + 0];
+                        cl_float dy = p[3*id + 1] - p[3*other + 1];
+                        cl_float dz = p[3*id + 2] - p[3*other + 2];
+                        dx -= length[0] * std::rint(dx / length[0]);
+                        dy -= length[1] * std::rint(dy / length[1]);
+                        dz -= length[2] * std::rint(dz / length[2]);
+                        cl_float r_sq = dx * dx + dy * dy + dz * dz;
+                        bool hit = other != id && r_sq < diameter * diameter && r_sq > 0.0f;
+                        cl_float r = std::sqrt(r_sq);
+                        cl_float scale = hit ? stiffness * (diameter - r) / r : 0.0f;
+                        fx += scale * dx;
+                        fy += scale * dy;
+                        fz += scale * dz;
+                    }
+                }
+            }
+        }
+
+        vel[3*id + 0] += Params::time_step * fx;
+        vel[3*id + 1] += Params::time_step * fy;
+        vel[3*id + 2] += Params::time_step * fz;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::random_points
+ * @brief Generate the points uniformly distributed inside the domain, as in
+ * the random_points kernel. Each point draws from its own counter, so the
+ * points do not depend on the number of threads.
+ */
+void CpuBackend::random_points(std::vector<cl_float> &pos, const cl_uint seed)
+{
+    const cl_uint n_points = Params::n_points;
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+    pos.resize(3 * n_points);
+    cl_float *p = pos.data();
+
+    #pragma omp parallel for
+    for (cl_uint i = 0; i < n_points; ++i) {
+        cl_uint ctr[4] = {i, 0, 0, 0};
+        cl_uint key[2] = {seed, 0};
+        philox4x32(ctr, key);
+        for (size_t k = 0; k < 3; ++k) {
+            const cl_float u = (cl_float) (ctr[k] >> 8) * (1.0f / 16777216.0f);
+            p[3 * i + k] = lo.s[k] + (hi.s[k] - lo.s[k]) * u;
+        }
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::update_points
+ * @brief Move the points with their velocities over a time step and wrap
+ * them back into the periodic domain, as in the update_points kernel.
+ */
+void CpuBackend::update_points(
+    std::vector<cl_float> &pos,
+    const std::vector<cl_float> &vel)
+{
+    const cl_uint n_points = Params::n_points;
+    const cl_float3 &lo = Params::domain_lo;
+    const cl_float3 &hi = Params::domain_hi;
+    const cl_float dt = Params::time_step;
+    cl_float *p = pos.data();
+    const cl_float *v = vel.data();
+
+    #pragma omp parallel for simd
+    for (cl_uint i = 0; i < 3 * n_points; ++i) {
+        const size_t k = i % 3;
+        const cl_float length = hi.s[k] - lo.s[k];
+        cl_float x = p[i] + dt * v[i];
+        p[i] = x - length * std::floor((x - lo.s[k]) / length);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * CpuBackend::build
+ * @brief Build the sorted cell list and the hashmap of the points.
+ */
+void CpuBackend::build(const std::vector<cl_float> &pos)
+{
+    cell_keys(pos);
+    sort();
+    hashmap_clear();
+    hashmap_build();
+}
@@ -0,0 +1,77 @@
+/*
+ * cpu.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef CPU_H_
+#define CPU_H_
+
+#include <vector>
+#include "model.hpp"
+
+/**
+ * CpuBackend
+ * Native multithreaded backend mirroring the OpenCL kernels on the host
+ * point arrays. Build a sorted cell list and its hashmap, then query it
+ * with SIMD distance tests. Used in place of the device pipeline, and as
+ * the reference to cross-check the device results.
+ */
+struct CpuBackend {
+    /* Sorted cell list and hashmap, in the device layout */
+    std::vector<Model::KeyValue> m_keys;
+    std::vector<Model::KeyValue> m_keys_swap;
+    std::vector<Model::Cell> m_hashmap;
+    std::vector<cl_uint> m_slots;               /* home slot of each key */
+
+    /* Query results in CSR format */
+    std::vector<cl_uint> m_offsets;
+    std::vector<cl_uint> m_indices;
+    std::vector<cl_float> m_density;            /* weight sum of each probe */
+    cl_uint m_query_size = 0;
+
+    /* Pipeline stages, named after their kernels. */
+    void cell_keys(const std::vector<cl_float> &pos);
+    void sort(void);
+    void hashmap_clear(void);
+    void hashmap_build(void);
+    void reorder_points(
+        std::vector<cl_float> &pos,
+        std::vector<cl_uchar4> &col,
+        std::vector<cl_uchar> &radius,
+        std::vector<cl_float> &vel);
+    void query(
+        const std::vector<cl_float> &pos,
+        const Model::Probe *probes,
+        const cl_uint n_probes);
+    void query_mark(
+        std::vector<cl_uchar4> &col,
+        std::vector<cl_uchar> &radius,
+        const std::vector<cl_float> &pos,
+        const cl_uint mark);
+    void compute_forces(
+        std::vector<cl_float> &vel,
+        const std::vector<cl_float> &pos);
+    void update_points(
+        std::vector<cl_float> &pos,
+        const std::vector<cl_float> &vel);
+    void random_points(std::vector<cl_float> &pos, const cl_uint seed);
+
+    /* Build the cell list and the hashmap of the points. */
+    void build(const std::vector<cl_float> &pos);
+
+    /* Radius query of a single probe, as in the query_probe kernel function. */
+    cl_uint query_probe(
+        const Model::Probe &probe,
+        const std::vector<cl_float> &pos,
+        cl_uint *indices,
+        const cl_uint offset) const;
+    cl_uint hashmap_find(const cl_ulong key) const;
+};
+
+#endif /* CPU_H_ */
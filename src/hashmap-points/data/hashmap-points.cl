@@ -3,177 +3,1719 @@
 #endif
 
 #define kEmpty          0xffffffff
-#define kGray           (float3) (0.5, 0.5, 0.5)
-#define kWhite          (float3) (1.0, 1.0, 1.0)
-#define kRadiusLarge    1.0
-#define kRadiusSmall    0.1
+#define kEmptyKey       0xffffffffffffffffUL
+#define kWhite          (uchar4) (255, 255, 255, 255)
+#define kRadiusLarge    (uchar) 255     /* 1.0 in unorm8 */
+#define kRadiusSmall    (uchar) 26      /* 0.1 in unorm8 */
+#define kProbeBins      16
+
+/*
+ * Model constants, defined by the host in the program build options:
+ *  N_POINTS, N_SORT, N_CELLS, CAPACITY, MAX_HITS, WORK_GROUP_SIZE,
+ *  DOMAIN_LO, DOMAIN_HI, TIME_STEP, STIFFNESS, DIAMETER
+ * and the surface constants if the surface is enabled.
+ * The hashmap capacity is a power of two, so slot indices wrap with a mask.
+ */
+#ifndef N_POINTS
+#error "model constants undefined, see Params::build_options"
+#endif
+
+#define kCapacityMask   (CAPACITY - 1)
+#define kWorkGroupSize  __attribute__((reqd_work_group_size(WORK_GROUP_SIZE, 1, 1)))
+
+/*
+ * Cell keys are 63-bit Morton codes with the top bit clear, so the high word
+ * of a valid key never equals the high word of kEmptyKey. Hashmap slots are
+ * claimed with a 32-bit compare-and-swap of the high word.
+ */
+#ifdef __ENDIAN_LITTLE__
+#define kKeyHiWord      1
+#else
+#define kKeyHiWord      0
+#endif
 
 /** ---------------------------------------------------------------------------
- * Point data type.
+ * Point data is stored in structure-of-arrays layout:
+ *  pos     packed float xyz triplets, accessed with vload3/vstore3
+ *  vel     packed float xyz triplets, accessed with vload3/vstore3
+ *  col     RGBA8 colors
+ *  radius  unorm8 radii, in units of the point scale
  */
-typedef struct {
-    float3 pos;
-    float3 col;
-    float radius;
-} Point_t;
 
-/** KeyValue data type. */
+/** KeyValue data type, a (cell key, point id) pair in the sorted cell list. */
 typedef struct {
-    uint key;
+    ulong key;
     uint value;
 } KeyValue_t;
 
+/** Cell data type, a hashmap slot with the cell key and its [start, end)
+ *  range of point ids in the sorted cell list. */
+typedef struct {
+    ulong key;
+    uint start;
+    uint end;
+} Cell_t;
+
+/** Stats data type, hashmap build counters. */
+typedef struct {
+    uint n_slots;                   /* occupied slots */
+    uint n_collisions;              /* inserts whose home slot was taken */
+    uint max_probe;                 /* longest probe sequence */
+    uint sum_probe;                 /* sum of probe sequence lengths */
+    uint histogram[kProbeBins];     /* probe length histogram */
+} Stats_t;
+
+/** Probe data type, a query sphere. */
+typedef struct {
+    float3 pos;
+    float radius;
+} Probe_t;
+
 /** Hashmap hash function. */
-uint hash(const uint3 v);
+ulong hash(const ulong key);
+
+/** Cell index coordinates and cell key of a position in the domain. */
+uint3 cell_index(const float3 pos);
+ulong morton_spread(const uint v);
+ulong cell_key(const uint3 cell);
+
+/** Hashmap slot lookup. */
+uint hashmap_find(const __global Cell_t *hashmap, const ulong key);
+
+/** Sort order of two KeyValue pairs. */
+bool keyvalue_greater(const KeyValue_t a, const KeyValue_t b);
+
+/** Radius query of a single probe. */
+uint query_probe(
+    const Probe_t probe,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    const __global float *pos,
+    __global uint *indices,
+    const uint offset,
+    __global uchar4 *col,
+    __global uchar *radius);
+
+/** Point color and radius of a query hit. */
+void mark_point(
+    __global uchar4 *col,
+    __global uchar *radius,
+    const __global float *pos,
+    const uint id);
 
 /** ---------------------------------------------------------------------------
  * hash
- * Hashmap hash function.
+ * Hashmap hash function, the 64-bit finalizer of MurmurHash3.
  */
-uint hash(const uint3 v)
+ulong hash(const ulong key)
 {
-    const uint c1 = 73856093;
-    const uint c2 = 19349663;
-    const uint c3 = 83492791;
+    ulong h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdUL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53UL;
+    h ^= h >> 33;
+    return h;
+}
 
-    uint h1 = c1 * v.s0;
-    uint h2 = c2 * v.s1;
-    uint h3 = c3 * v.s2;
+/** ---------------------------------------------------------------------------
+ * philox4x32
+ * Counter-based random number generator Philox4x32-10. Map the counter and
+ * the key to four random words, so each point draws its own numbers from its
+ * id, independently of the work-item schedule.
+ */
+uint4 philox4x32(uint4 ctr, uint2 key)
+{
+    for (uint round = 0; round < 10; ++round) {
+        const uint lo0 = 0xD2511F53 * ctr.x;
+        const uint hi0 = mul_hi(0xD2511F53u, ctr.x);
+        const uint lo1 = 0xCD9E8D57 * ctr.z;
+        const uint hi1 = mul_hi(0xCD9E8D57u, ctr.z);
+        ctr = (uint4) (hi1 ^ ctr.y ^ key.x, lo1, hi0 ^ ctr.w ^ key.y, lo0);
+        key += (uint2) (0x9E3779B9, 0xBB67AE85);
+    }
+    return ctr;
+}
 
-    return (h1 ^ h2 ^ h3);
-    // return (7*h1 + 503*h2 + 24847*h3);
+/** ---------------------------------------------------------------------------
+ * cell_index
+ * Compute the index coordinates of the cell containing the position, clamped
+ * to the domain grid.
+ */
+uint3 cell_index(const float3 pos)
+{
+    float3 u_pos = (pos - DOMAIN_LO) / (DOMAIN_HI - DOMAIN_LO);
+    uint3 cell = convert_uint3_sat((float) N_CELLS * u_pos);
+    return min(cell, (uint3) (N_CELLS - 1));
+}
+
+/**
+ * morton_spread
+ * Spread the lower 21 bits of v so that there are two zero bits between
+ * each pair of consecutive bits.
+ */
+ulong morton_spread(const uint v)
+{
+    ulong x = v & 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffUL;
+    x = (x | x << 16) & 0x1f0000ff0000ffUL;
+    x = (x | x << 8)  & 0x100f00f00f00f00fUL;
+    x = (x | x << 4)  & 0x10c30c30c30c30c3UL;
+    x = (x | x << 2)  & 0x1249249249249249UL;
+    return x;
+}
+
+/**
+ * cell_key
+ * Compute the cell key, the Morton code of the cell index coordinates. The
+ * key is exact for up to 2^21 cells along each dimension.
+ */
+ulong cell_key(const uint3 cell)
+{
+    return morton_spread(cell.x)
+        | (morton_spread(cell.y) << 1)
+        | (morton_spread(cell.z) << 2);
 }
 
 /** ---------------------------------------------------------------------------
- * hashmap_clear
- * Clear the hashmap.
+ * hashmap_find
+ * Linearly probe the hashmap for the slot holding the key. Return kEmpty if
+ * the key is not in the hashmap.
  */
-__kernel void hashmap_clear(
-    __global KeyValue_t *hashmap,
-    const uint capacity)
+uint hashmap_find(const __global Cell_t *hashmap, const ulong key)
 {
+    uint slot = hash(key) & kCapacityMask;
+    for (uint i = 0; i < CAPACITY; ++i) {
+        ulong slot_key = hashmap[slot].key;
+        if (slot_key == key) {
+            return slot;
+        }
+        if (slot_key == kEmptyKey) {
+            return kEmpty;
+        }
+        slot = (slot + 1) & kCapacityMask;
+    }
+    return kEmpty;
+}
+
+/** ---------------------------------------------------------------------------
+ * keyvalue_greater
+ * Order KeyValue pairs by key and then by value.
+ */
+bool keyvalue_greater(const KeyValue_t a, const KeyValue_t b)
+{
+    return (a.key > b.key) || (a.key == b.key && a.value > b.value);
+}
+
+/** ---------------------------------------------------------------------------
+ * mark_point
+ * Color the point by its position in the domain and enlarge it.
+ */
+void mark_point(
+    __global uchar4 *col,
+    __global uchar *radius,
+    const __global float *pos,
+    const uint id)
+{
+    float3 u_pos = (vload3(id, pos) - DOMAIN_LO) / (DOMAIN_HI - DOMAIN_LO);
+    col[id] = convert_uchar4_sat_rte((float4) (u_pos, 1.0f) * 255.0f);
+    radius[id] = kRadiusLarge;
+}
+
+/** ---------------------------------------------------------------------------
+ * query_probe
+ * Visit the cells overlapping the probe sphere, with periodic boundary
+ * conditions, and count the points within the probe radius. If indices is
+ * not null, store the ids of the points starting at offset, up to MAX_HITS.
+ * If col is not null, mark the stored points as they are found.
+ * Return the number of points found.
+ */
+uint query_probe(
+    const Probe_t probe,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    const __global float *pos,
+    __global uint *indices,
+    const uint offset,
+    __global uchar4 *col,
+    __global uchar *radius)
+{
+    const float3 length = DOMAIN_HI - DOMAIN_LO;
+    const float3 width = length / (float) N_CELLS;
+    const float radius_sq = probe.radius * probe.radius;
+
+    /* Range of cells overlapping the probe, at most N_CELLS along each axis */
+    const int3 n = (int3) ((int) N_CELLS);
+    int3 c_lo = convert_int3(floor((probe.pos - probe.radius - DOMAIN_LO) / width));
+    int3 c_hi = convert_int3(floor((probe.pos + probe.radius - DOMAIN_LO) / width));
+    c_hi = select(c_hi, c_lo + n - 1, c_hi - c_lo >= n);
+
+    uint count = 0;
+    for (int z = c_lo.z; z <= c_hi.z; ++z) {
+        for (int y = c_lo.y; y <= c_hi.y; ++y) {
+            for (int x = c_lo.x; x <= c_hi.x; ++x) {
+                int3 cell = (((int3) (x, y, z) % n) + n) % n;
+                uint slot = hashmap_find(hashmap, cell_key(convert_uint3(cell)));
+                if (slot == kEmpty) {
+                    continue;
+                }
+
+                const uint start = hashmap[slot].start;
+                const uint end = hashmap[slot].end;
+
+                /*
+                 * Keys are exact, so every point in a cell lying entirely
+                 * inside the probe sphere is a hit without a distance check.
+                 */
+                float3 cell_lo = DOMAIN_LO + width * convert_float3((int3) (x, y, z));
+                float3 far = fmax(
+                    fabs(probe.pos - cell_lo),
+                    fabs(probe.pos - (cell_lo + width)));
+                if (dot(far, far) <= radius_sq) {
+                    for (uint i = start; indices && i < end; ++i) {
+                        uint hit = offset + count + (i - start);
+                        if (hit < MAX_HITS) {
+                            indices[hit] = keys[i].value;
+                            if (col) {
+                                mark_point(col, radius, pos, keys[i].value);
+                            }
+                        }
+                    }
+                    count += end - start;
+                    continue;
+                }
+
+                for (uint i = start; i < end; ++i) {
+                    uint id = keys[i].value;
+                    float3 d = vload3(id, pos) - probe.pos;
+                    d -= length * rint(d / length);     /* minimum image */
+                    if (dot(d, d) > radius_sq) {
+                        continue;
+                    }
+
+                    if (indices && offset + count < MAX_HITS) {
+                        indices[offset + count] = id;
+                        if (col) {
+                            mark_point(col, radius, pos, id);
+                        }
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/** ---------------------------------------------------------------------------
+ * bitonic_sort_global
+ * Bitonic merge step (k, j) over the whole KeyValue array in global memory.
+ * The array size is a power of two and the kernel runs one work-item per
+ * element.
+ */
+__kernel kWorkGroupSize void bitonic_sort_global(
+    __global KeyValue_t *keys,
+    const uint k,
+    const uint j)
+{
+    const uint id = get_global_id(0);
+    const uint ixj = id ^ j;
+    if (ixj > id) {
+        KeyValue_t a = keys[id];
+        KeyValue_t b = keys[ixj];
+        bool ascending = (id & k) == 0;
+        if (keyvalue_greater(a, b) == ascending) {
+            keys[id] = b;
+            keys[ixj] = a;
+        }
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * bitonic_sort_local
+ * Bitonic merge steps (k, j), (k, j/2), ..., (k, 1) in local memory. Valid
+ * when j is less than the work-group size, so that every compare partner
+ * lies in the same work-group.
+ */
+__kernel kWorkGroupSize void bitonic_sort_local(
+    __global KeyValue_t *keys,
+    const uint k,
+    const uint j)
+{
+    __local KeyValue_t scratch[WORK_GROUP_SIZE];
     const uint id = get_global_id(0);
-    if (id < capacity) {
-        hashmap[id].key = kEmpty;
+    const uint lid = get_local_id(0);
+    const bool ascending = (id & k) == 0;
+
+    scratch[lid] = keys[id];
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    for (uint step = j; step > 0; step >>= 1) {
+        uint ixj = lid ^ step;
+        if (ixj > lid) {
+            KeyValue_t a = scratch[lid];
+            KeyValue_t b = scratch[ixj];
+            if (keyvalue_greater(a, b) == ascending) {
+                scratch[lid] = b;
+                scratch[ixj] = a;
+            }
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
     }
+
+    keys[id] = scratch[lid];
 }
 
 /** ---------------------------------------------------------------------------
  * hashmap_build
- * Insert a set of points into the hashmap KeyValue array.
- * For each point, compute the index coordinates of the cell that contains it.
- * Compute the hash key associated with the cell and its corresponding slot
- * in the hashmap.
- * Linearly probe the map and insert the key in the first empty slot marked
- * as kEmpty. When found, store the point id in the slot value.
- */
-__kernel void hashmap_build(
-    __global KeyValue_t *hashmap,
-    const uint capacity,
-    const __global Point_t *points,
-    const uint n_points,
-    const uint n_cells,
-    const float3 domain_lo,
-    const float3 domain_hi)
-{
-    const uint id = get_global_id(0);
-    if (id < n_points) {
-        float3 u_pos = (points[id].pos - domain_lo) / (domain_hi - domain_lo);
-        uint3 cell_ix = (uint3) (
-            (float) n_cells * u_pos.x,
-            (float) n_cells * u_pos.y,
-            (float) n_cells * u_pos.z);
-
-        uint key = hash(cell_ix);
-        uint slot = key % capacity;
+ * Insert the cells of the sorted cell list into the hashmap.
+ * The work-item at the start of each run of equal keys finds the end of the
+ * run by binary search, computes the slot of the cell key in the hashmap and
+ * linearly probes the map for the first empty slot marked as kEmptyKey. When
+ * found, store the cell key and its [start, end) range in the slot.
+ * If collect is set, accumulate the probe sequence length of the insertion
+ * in the stats counters.
+ */
+__kernel kWorkGroupSize void hashmap_build(
+    __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    __global Stats_t *stats,
+    const uint collect)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        ulong key = keys[id].key;
+        if (id > 0 && keys[id - 1].key == key) {
+            return;
+        }
+
+        /* Find the end of the run, the first pair with a greater key. */
+        uint lo = id + 1;
+        uint hi = N_POINTS;
+        while (lo < hi) {
+            uint mid = lo + (hi - lo) / 2;
+            if (keys[mid].key == key) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+
+        uint slot = hash(key) & kCapacityMask;
+        uint probe = 0;
         while (true) {
             uint prev = atomic_cmpxchg(
-                (volatile __global unsigned int *) (&hashmap[slot].key),
+                (volatile __global unsigned int *) (&hashmap[slot].key) + kKeyHiWord,
                 kEmpty,
-                key);
+                (uint) (key >> 32));
 
             if (prev == kEmpty) {
-                hashmap[slot].value = id;
+                hashmap[slot].key = key;
+                hashmap[slot].start = id;
+                hashmap[slot].end = lo;
+
+                if (collect) {
+                    atomic_inc(&stats->n_slots);
+                    if (probe > 0) {
+                        atomic_inc(&stats->n_collisions);
+                    }
+                    atomic_max(&stats->max_probe, probe);
+                    atomic_add(&stats->sum_probe, probe);
+                    atomic_inc(&stats->histogram[min(probe, (uint) (kProbeBins - 1))]);
+                }
                 return;
             }
 
-            slot = (slot + 1) % capacity;   // & (capacity - 1);
+            probe++;
+
+            slot = (slot + 1) & kCapacityMask;
         }
     }
 }
 
 /** ---------------------------------------------------------------------------
- * hashmap_query
- * Query the hashamp for the set points that belong to the same cell as the
- * probe. Color each point accordingly.
+ * random_points
+ * Generate the points uniformly distributed inside the domain. The point
+ * coordinates are the upper 24 bits of the Philox words of the point id.
+ */
+__kernel kWorkGroupSize void random_points(
+    __global float *pos,
+    const uint seed)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        const uint4 r = philox4x32((uint4) (id, 0, 0, 0), (uint2) (seed, 0));
+        const float3 u = convert_float3(r.xyz >> 8) * (1.0f / 16777216.0f);
+        vstore3(DOMAIN_LO + (DOMAIN_HI - DOMAIN_LO) * u, id, pos);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * point_ids
+ * Set the original id of each point, its index in the initial storage order.
+ */
+__kernel kWorkGroupSize void point_ids(__global uint *ids)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        ids[id] = id;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * reorder_points
+ * Gather the point arrays in the order of the sorted cell list, which is the
+ * Morton order of their cells, and reset the point ids of the cell list to
+ * the new storage order. Cell ranges in the hashmap remain valid. The
+ * original ids are gathered along, to write the points in their original
+ * order.
+ */
+__kernel kWorkGroupSize void reorder_points(
+    __global float *pos_out,
+    __global uchar4 *col_out,
+    __global uchar *radius_out,
+    __global float *vel_out,
+    __global uint *ids_out,
+    const __global float *pos_in,
+    const __global uchar4 *col_in,
+    const __global uchar *radius_in,
+    const __global float *vel_in,
+    const __global uint *ids_in,
+    __global KeyValue_t *keys)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        const uint src = keys[id].value;
+        vstore3(vload3(src, pos_in), id, pos_out);
+        vstore3(vload3(src, vel_in), id, vel_out);
+        col_out[id] = col_in[src];
+        radius_out[id] = radius_in[src];
+        ids_out[id] = ids_in[src];
+        keys[id].value = id;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * query_count
+ * Count the points within the radius of each probe.
  */
-__kernel void hashmap_query(
-    __global Point_t *points,
-    const uint n_points,
-    const uint n_cells,
-    const float3 domain_lo,
-    const float3 domain_hi,
-    const Point_t probe)
+__kernel kWorkGroupSize void query_count(
+    __global uint *counts,
+    const __global Probe_t *probes,
+    const uint n_probes,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    const __global float *pos)
 {
     const uint id = get_global_id(0);
-    if (id < n_points) {
-        /* Probe hash key */
-        float3 probe_upos = (probe.pos - domain_lo) / (domain_hi - domain_lo);
-        uint3 probe_cell = (uint3) (
-            (float) n_cells * probe_upos.x,
-            (float) n_cells * probe_upos.y,
-            (float) n_cells * probe_upos.z);
-        uint probe_key = hash(probe_cell);
+    if (id < n_probes) {
+        counts[id] = query_probe(
+            probes[id],
+            hashmap,
+            keys,
+            pos,
+            (__global uint *) 0,
+            0,
+            (__global uchar4 *) 0,
+            (__global uchar *) 0);
+    }
+}
 
-        /* Point hash key */
-        float3 point_upos = (points[id].pos - domain_lo) / (domain_hi - domain_lo);
-        uint3 point_cell = (uint3) (
-            (float) n_cells * point_upos.x,
-            (float) n_cells * point_upos.y,
-            (float) n_cells * point_upos.z);
-        uint point_key = hash(point_cell);
+/** ---------------------------------------------------------------------------
+ * query_fill
+ * Store the ids of the points within the radius of each probe in the CSR
+ * indices array, starting at the probe offset. Indices beyond MAX_HITS are
+ * dropped, and the total count in offsets[n_probes] flags the overflow.
+ * If mark is set, color the stored points in the same pass.
+ */
+__kernel kWorkGroupSize void query_fill(
+    __global uint *indices,
+    const __global uint *offsets,
+    const __global Probe_t *probes,
+    const uint n_probes,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    const __global float *pos,
+    __global uchar4 *col,
+    __global uchar *radius,
+    const uint mark)
+{
+    const uint id = get_global_id(0);
+    if (id < n_probes) {
+        query_probe(
+            probes[id],
+            hashmap,
+            keys,
+            pos,
+            indices,
+            offsets[id],
+            mark ? col : (__global uchar4 *) 0,
+            radius);
+    }
+}
 
-        /* Color the point by its distance to the probe */
-        if (point_key == probe_key) {
-            points[id].col = point_upos;
-            points[id].radius = kRadiusLarge;
+/** ---------------------------------------------------------------------------
+ * query_mark
+ * Color the points found by each probe if mark is set, otherwise reset the
+ * point color. Each work-group visits the CSR range of one probe.
+ */
+__kernel kWorkGroupSize void query_mark(
+    __global uchar4 *col,
+    __global uchar *radius,
+    const __global float *pos,
+    const __global uint *offsets,
+    const __global uint *indices,
+    const uint n_probes,
+    const uint mark)
+{
+    const uint group = get_group_id(0);
+    if (group >= n_probes) {
+        return;
+    }
+
+    const uint start = offsets[group];
+    const uint end = min(offsets[group + 1], (uint) MAX_HITS);
+    for (uint i = start + get_local_id(0); i < end; i += WORK_GROUP_SIZE) {
+        uint id = indices[i];
+        if (mark) {
+            mark_point(col, radius, pos, id);
         } else {
-            points[id].col = kWhite;
-            points[id].radius = kRadiusSmall;
+            col[id] = kWhite;
+            radius[id] = kRadiusSmall;
         }
     }
 }
 
+/** ---------------------------------------------------------------------------
+ * query_weights
+ * Store the weight (1 - r^2/R^2)^2 of each point found by each probe, with r
+ * the minimum image distance of the point to the probe and R the probe
+ * radius. Summed over the CSR range of a probe, the weights give the point
+ * density around it. Each work-group visits the CSR range of one probe.
+ */
+__kernel kWorkGroupSize void query_weights(
+    __global float *weights,
+    const __global float *pos,
+    const __global uint *offsets,
+    const __global uint *indices,
+    const __global Probe_t *probes,
+    const uint n_probes)
+{
+    const uint group = get_group_id(0);
+    if (group >= n_probes) {
+        return;
+    }
+
+    const float3 length = DOMAIN_HI - DOMAIN_LO;
+    const Probe_t probe = probes[group];
+    const float radius_sq = probe.radius * probe.radius;
+    const uint start = offsets[group];
+    const uint end = min(offsets[group + 1], (uint) MAX_HITS);
+    for (uint i = start + get_local_id(0); i < end; i += WORK_GROUP_SIZE) {
+        float3 d = vload3(indices[i], pos) - probe.pos;
+        d -= length * rint(d / length);         /* minimum image */
+        float w = fmax(1.0f - dot(d, d) / radius_sq, 0.0f);
+        weights[i] = w * w;
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Scan, compaction and segmented reduction primitives.
+ * The exclusive scan is work-efficient: each work-group scans a block of
+ * kScanBlock values in local memory with an up-sweep and a down-sweep, and
+ * stores the block total. The host scans the block totals recursively and
+ * adds them back to each block, with the total of all values in out[n].
+ * If enable is not null, the scan runs only if *enable is set, so a scan
+ * of unchanged values is skipped on the device.
+ */
+#define kScanBlock      (2 * WORK_GROUP_SIZE)
+
+/**
+ * scan_blocks
+ * Exclusive prefix sum of each block of n values, with the block totals in
+ * sums. A single block also stores the total in out[n]. The input may be
+ * the output buffer.
+ */
+__kernel kWorkGroupSize void scan_blocks(
+    __global uint *out,
+    __global uint *sums,
+    const __global uint *in,
+    const uint n,
+    const __global uint *enable)
+{
+    if (enable && *enable == 0) {
+        return;
+    }
+
+    __local uint scratch[kScanBlock];
+    const uint lid = get_local_id(0);
+    const uint a = get_group_id(0) * kScanBlock + lid;
+    const uint b = a + WORK_GROUP_SIZE;
+
+    scratch[lid] = (a < n) ? in[a] : 0;
+    scratch[lid + WORK_GROUP_SIZE] = (b < n) ? in[b] : 0;
+
+    /* Up-sweep, reduce the block into a tree of partial sums. */
+    uint offset = 1;
+    for (uint d = WORK_GROUP_SIZE; d > 0; d >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d) {
+            uint i = offset * (2 * lid + 1) - 1;
+            uint j = offset * (2 * lid + 2) - 1;
+            scratch[j] += scratch[i];
+        }
+        offset <<= 1;
+    }
+
+    /* Store the block total and clear the root. */
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (lid == 0) {
+        const uint total = scratch[kScanBlock - 1];
+        sums[get_group_id(0)] = total;
+        if (get_num_groups(0) == 1) {
+            out[n] = total;
+        }
+        scratch[kScanBlock - 1] = 0;
+    }
+
+    /* Down-sweep, distribute the partial sums back down the tree. */
+    for (uint d = 1; d < kScanBlock; d <<= 1) {
+        offset >>= 1;
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d) {
+            uint i = offset * (2 * lid + 1) - 1;
+            uint j = offset * (2 * lid + 2) - 1;
+            uint t = scratch[i];
+            scratch[i] = scratch[j];
+            scratch[j] += t;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if (a < n) {
+        out[a] = scratch[lid];
+    }
+    if (b < n) {
+        out[b] = scratch[lid + WORK_GROUP_SIZE];
+    }
+}
+
+/**
+ * scan_add
+ * Add the scanned block totals to each block of n values, and store the
+ * total of all values, sums[n_blocks], in out[n].
+ */
+__kernel kWorkGroupSize void scan_add(
+    __global uint *out,
+    const __global uint *sums,
+    const uint n,
+    const __global uint *enable)
+{
+    if (enable && *enable == 0) {
+        return;
+    }
+
+    const uint group = get_group_id(0);
+    const uint a = group * kScanBlock + get_local_id(0);
+    const uint b = a + WORK_GROUP_SIZE;
+    const uint sum = sums[group];
+
+    if (a < n) {
+        out[a] += sum;
+    }
+    if (b < n) {
+        out[b] += sum;
+    }
+    if (get_global_id(0) == 0) {
+        out[n] = sums[get_num_groups(0)];
+    }
+}
+
+/**
+ * compact_indices
+ * Store the index of each flagged value at its offset, the exclusive scan
+ * of the flags, so the flagged indices are listed in order. The number of
+ * indices is offsets[n].
+ */
+__kernel kWorkGroupSize void compact_indices(
+    __global uint *indices,
+    const __global uint *offsets,
+    const uint n)
+{
+    const uint id = get_global_id(0);
+    if (id < n) {
+        const uint offset = offsets[id];
+        if (offsets[id + 1] > offset) {
+            indices[offset] = id;
+        }
+    }
+}
+
+/**
+ * segment_sum
+ * Sum the values of each segment [offsets[s], offsets[s+1]), clamped to
+ * n_values. Each work-group reduces one segment in local memory.
+ */
+__kernel kWorkGroupSize void segment_sum(
+    __global float *out,
+    const __global float *values,
+    const __global uint *offsets,
+    const uint n_segments,
+    const uint n_values)
+{
+    __local float scratch[WORK_GROUP_SIZE];
+    const uint group = get_group_id(0);
+    const uint lid = get_local_id(0);
+    if (group >= n_segments) {
+        return;
+    }
+
+    const uint start = offsets[group];
+    const uint end = min(offsets[group + 1], n_values);
+    float sum = 0.0f;
+    for (uint i = start + lid; i < end; i += WORK_GROUP_SIZE) {
+        sum += values[i];
+    }
+    scratch[lid] = sum;
+
+    for (uint d = WORK_GROUP_SIZE >> 1; d > 0; d >>= 1) {
+        barrier(CLK_LOCAL_MEM_FENCE);
+        if (lid < d) {
+            scratch[lid] += scratch[lid + d];
+        }
+    }
+
+    if (lid == 0) {
+        out[group] = scratch[0];
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * pair_force
+ * Soft-sphere repulsion on the point from another point, at the minimum
+ * image displacement d between them, F = k (d - r) r/|r|, or zero if they
+ * are not closer than the sphere diameter.
+ */
+float3 pair_force(const float3 d)
+{
+    const float r_sq = dot(d, d);
+    if (r_sq >= DIAMETER * DIAMETER || r_sq == 0.0f) {
+        return (float3) (0.0f);
+    }
+    const float r = sqrt(r_sq);
+    return (STIFFNESS * (DIAMETER - r) / r) * d;
+}
+
+/** ---------------------------------------------------------------------------
+ * cell_forces
+ * Sum the pair forces on the point from the other points in the 27 cells
+ * around the point cell with periodic boundary conditions. Requires a cell
+ * width not less than the diameter and at least 3 cells along each axis.
+ */
+float3 cell_forces(
+    const uint id,
+    const __global float *pos,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys)
+{
+    const float3 length = DOMAIN_HI - DOMAIN_LO;
+    const float3 p = vload3(id, pos);
+    const int3 n = (int3) ((int) N_CELLS);
+    const int3 c = convert_int3(cell_index(p));
+
+    float3 force = (float3) (0.0f);
+    #pragma unroll
+    for (int z = -1; z <= 1; ++z) {
+        #pragma unroll
+        for (int y = -1; y <= 1; ++y) {
+            #pragma unroll
+            for (int x = -1; x <= 1; ++x) {
+                int3 cell = ((c + (int3) (x, y, z)) % n + n) % n;
+                uint slot = hashmap_find(hashmap, cell_key(convert_uint3(cell)));
+                if (slot == kEmpty) {
+                    continue;
+                }
+
+                const uint end = hashmap[slot].end;
+                for (uint i = hashmap[slot].start; i < end; ++i) {
+                    uint other = keys[i].value;
+                    if (other == id) {
+                        continue;
+                    }
+                    float3 d = p - vload3(other, pos);
+                    d -= length * rint(d / length);     /* minimum image */
+                    force += pair_force(d);
+                }
+            }
+        }
+    }
+    return force;
+}
+
+/** ---------------------------------------------------------------------------
+ * compute_forces
+ * Soft-sphere repulsion between points closer than the sphere diameter,
+ * with the neighbors found in the hashmap. Integrate the velocity of each
+ * point of unit mass over a time step.
+ */
+__kernel kWorkGroupSize void compute_forces(
+    __global float *vel,
+    const __global float *pos,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        float3 force = cell_forces(id, pos, hashmap, keys);
+        vstore3(vload3(id, vel) + TIME_STEP * force, id, vel);
+    }
+}
+
 /** ---------------------------------------------------------------------------
  * update_points
+ * First pass of the frame over the points. Move the points with their
+ * velocities over a time step, wrap them back into the periodic domain and
+ * compute their (cell key, point id) pairs. Pad the pairs up to the sort
+ * size with kEmptyKey pairs that sort after every point, and clear the
+ * hashmap. Runs over the larger of the sort size and the hashmap capacity.
  */
-__kernel void update_points(
-    const __global Point_t *points,
-    const uint n_points,
-    const float3 domain_lo,
-    const float3 domain_hi)
+__kernel kWorkGroupSize void update_points(
+    __global float *pos,
+    __global KeyValue_t *keys,
+    __global Cell_t *hashmap,
+    const __global float *vel)
 {
     const uint id = get_global_id(0);
-    if (id < n_points) {
+    if (id < N_POINTS) {
+        const float3 length = DOMAIN_HI - DOMAIN_LO;
+        float3 p = vload3(id, pos) + TIME_STEP * vload3(id, vel);
+        p -= length * floor((p - DOMAIN_LO) / length);
+        vstore3(p, id, pos);
+
+        keys[id].key = cell_key(cell_index(p));
+        keys[id].value = id;
+    } else if (id < N_SORT) {
+        keys[id].key = kEmptyKey;
+        keys[id].value = kEmpty;
+    }
+
+    if (id < CAPACITY) {
+        hashmap[id].key = kEmptyKey;
     }
 }
 
 /** ---------------------------------------------------------------------------
- * update_vertex
+ * Point vertices are packed into 12 bytes, for drawing as camera facing
+ * sprites of 4 triangle strip vertices:
+ *  pos     unorm16 xyz in the domain and the radius, in units of the point
+ *          scale, as the unorm16 expansion of its unorm8 value
+ *  col     RGBA8 color
+ * The vertex buffers are accessed as uint triplets.
  */
-__kernel void update_vertex(
-    __global float *vertex,
-    const __global Point_t *points,
-    const uint n_points)
+
+#define kSpriteVertices 4               /* triangle strip per sprite */
+
+/** Indirect draw arguments, the layout of DrawArraysIndirectCommand. */
+typedef struct {
+    uint count;
+    uint instance_count;
+    uint first;
+    uint base_instance;
+} DrawArgs_t;
+
+/** Pack the point vertex at the index of the vertex buffer. */
+void pack_point(
+    __global uint *vertices,
+    const uint index,
+    const __global float *pos,
+    const __global uchar4 *col,
+    const __global uchar *radius,
+    const uint id);
+
+/**
+ * pack_point
+ * Pack the point vertex. Positions are in the periodic domain, so the
+ * saturation only clamps rounding at the domain bounds.
+ */
+void pack_point(
+    __global uint *vertices,
+    const uint index,
+    const __global float *pos,
+    const __global uchar4 *col,
+    const __global uchar *radius,
+    const uint id)
+{
+    const float3 u = (vload3(id, pos) - DOMAIN_LO) / (DOMAIN_HI - DOMAIN_LO);
+    const ushort4 p = (ushort4) (
+        convert_ushort3_sat_rte(65535.0f * u),
+        (ushort) (257 * radius[id]));
+    vstore4(p, 0, (__global ushort *) &vertices[3 * index]);
+    vertices[3 * index + 2] = as_uint(col[id]);
+}
+
+/**
+ * pack_points
+ * Pack every point into the vertex buffer.
+ */
+__kernel kWorkGroupSize void pack_points(
+    __global uint *vertices,
+    const __global float *pos,
+    const __global uchar4 *col,
+    const __global uchar *radius)
 {
     const uint id = get_global_id(0);
-    if (id < n_points) {
-        vertex[7*id + 0] = points[id].pos.x;
-        vertex[7*id + 1] = points[id].pos.y;
-        vertex[7*id + 2] = points[id].pos.z;
-        vertex[7*id + 3] = points[id].col.x;
-        vertex[7*id + 4] = points[id].col.y;
-        vertex[7*id + 5] = points[id].col.z;
-        vertex[7*id + 6] = points[id].radius;
+    if (id < N_POINTS) {
+        pack_point(vertices, id, pos, col, radius, id);
     }
 }
+
+/** ---------------------------------------------------------------------------
+ * Frustum culling. The view frustum is given by the row-major product of the
+ * camera projection and view matrices. Its planes are the sums and the
+ * differences of the last matrix row with the other rows, in world space.
+ */
+
+/**
+ * cull_points
+ * Flag the points whose sprites are within the margin of every frustum
+ * plane. The sprite is bounded by a sphere of the point radius, in units
+ * of the point scale.
+ */
+__kernel kWorkGroupSize void cull_points(
+    __global uint *flags,
+    const __global float *pos,
+    const __global uchar *radius,
+    const float margin,
+    const float16 view_persp,
+    const float scale)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        const float4 p = (float4) (vload3(id, pos), 1.0f);
+        const float r = scale * (float) radius[id] / 255.0f + margin;
+        const float4 rows[3] = {view_persp.s0123, view_persp.s4567, view_persp.s89ab};
+        const float4 w = view_persp.scdef;
+
+        uint visible = 1;
+        for (uint i = 0; i < 3; ++i) {
+            const float4 lo = w + rows[i];
+            const float4 hi = w - rows[i];
+            visible &= dot(lo, p) >= -r * length(lo.xyz);
+            visible &= dot(hi, p) >= -r * length(hi.xyz);
+        }
+        flags[id] = visible;
+    }
+}
+
+/**
+ * cull_compact
+ * Pack the visible points at their offsets, the exclusive scan of the
+ * visibility flags, into the vertex buffer.
+ */
+__kernel kWorkGroupSize void cull_compact(
+    __global uint *vertices,
+    const __global uint *offsets,
+    const __global float *pos,
+    const __global uchar4 *col,
+    const __global uchar *radius)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        const uint offset = offsets[id];
+        if (offsets[id + 1] > offset) {
+            pack_point(vertices, offset, pos, col, radius, id);
+        }
+    }
+}
+
+/**
+ * cull_draw_args
+ * Store the indirect draw arguments of the visible point sprites. Runs in
+ * a single work-item.
+ */
+__kernel void cull_draw_args(
+    __global DrawArgs_t *args,
+    const __global uint *offsets)
+{
+    args->count = kSpriteVertices;
+    args->instance_count = offsets[N_POINTS];
+    args->first = 0;
+    args->base_instance = 0;
+}
+
+/** ---------------------------------------------------------------------------
+ * Neighbor lists, compiled if NEIGHBOR_CUTOFF is defined by the host:
+ *  NEIGHBOR_CUTOFF, NEIGHBOR_SKIN, MAX_NEIGHBORS
+ * The neighbor list of each point holds the points within the cutoff plus
+ * the skin, in CSR format, and stays valid while no point moves more than
+ * half the skin from its position at the last build. The lists are rebuilt
+ * only when the rebuild flag is set, by a point moving further or by the
+ * host after a reorder. The forces use the lists in place of the hashmap.
+ * Requires a cutoff not below the sphere diameter, and a cutoff plus skin
+ * not above the cell width.
+ */
+#if defined(NEIGHBOR_CUTOFF)
+
+#define kNeighborRange  (NEIGHBOR_CUTOFF + NEIGHBOR_SKIN)
+
+/** ---------------------------------------------------------------------------
+ * neighbor_visit
+ * Visit the 27 cells around the point cell, with periodic boundary
+ * conditions, and count the other points within the neighbor range. If
+ * indices is not null, store their ids starting at offset, up to
+ * MAX_NEIGHBORS. Return the number of neighbors found.
+ */
+uint neighbor_visit(
+    const uint id,
+    const __global float *pos,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    __global uint *indices,
+    const uint offset)
+{
+    const float3 length = DOMAIN_HI - DOMAIN_LO;
+    const float3 p = vload3(id, pos);
+    const int3 n = (int3) ((int) N_CELLS);
+    const int3 c = convert_int3(cell_index(p));
+
+    uint count = 0;
+    for (int z = -1; z <= 1; ++z) {
+        for (int y = -1; y <= 1; ++y) {
+            for (int x = -1; x <= 1; ++x) {
+                int3 cell = ((c + (int3) (x, y, z)) % n + n) % n;
+                uint slot = hashmap_find(hashmap, cell_key(convert_uint3(cell)));
+                if (slot == kEmpty) {
+                    continue;
+                }
+
+                const uint end = hashmap[slot].end;
+                for (uint i = hashmap[slot].start; i < end; ++i) {
+                    uint other = keys[i].value;
+                    float3 d = p - vload3(other, pos);
+                    d -= length * rint(d / length);     /* minimum image */
+                    if (other == id || dot(d, d) > kNeighborRange * kNeighborRange) {
+                        continue;
+                    }
+
+                    if (indices && offset + count < MAX_NEIGHBORS) {
+                        indices[offset + count] = other;
+                    }
+                    count++;
+                }
+            }
+        }
+    }
+
+    return count;
+}
+
+/** ---------------------------------------------------------------------------
+ * neighbor_check
+ * Set the rebuild flag if the point moved more than half the skin since the
+ * last build, so that a pair outside the lists may now be within the cutoff.
+ * Every work-item that sets the flag writes the same value.
+ */
+__kernel kWorkGroupSize void neighbor_check(
+    __global uint *rebuild,
+    const __global float *pos,
+    const __global float *ref_pos)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS) {
+        const float3 length = DOMAIN_HI - DOMAIN_LO;
+        float3 d = vload3(id, pos) - vload3(id, ref_pos);
+        d -= length * rint(d / length);         /* minimum image */
+        if (dot(d, d) > 0.25f * NEIGHBOR_SKIN * NEIGHBOR_SKIN) {
+            *rebuild = 1;
+        }
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * neighbor_count
+ * Count the neighbors of each point, if the lists are rebuilt.
+ */
+__kernel kWorkGroupSize void neighbor_count(
+    __global uint *counts,
+    const __global uint *rebuild,
+    const __global float *pos,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS && *rebuild) {
+        counts[id] = neighbor_visit(id, pos, hashmap, keys, NULL, 0);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * neighbor_fill
+ * Store the neighbors of each point at its CSR offset, if the lists are
+ * rebuilt, and keep the point position of the build.
+ */
+__kernel kWorkGroupSize void neighbor_fill(
+    __global uint *indices,
+    __global float *ref_pos,
+    const __global uint *offsets,
+    const __global uint *rebuild,
+    const __global float *pos,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys)
+{
+    const uint id = get_global_id(0);
+    if (id < N_POINTS && *rebuild) {
+        neighbor_visit(id, pos, hashmap, keys, indices, offsets[id]);
+        vstore3(vload3(id, pos), id, ref_pos);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * neighbor_forces
+ * Soft-sphere repulsion as in compute_forces, with the neighbors in the
+ * neighbor lists. Requires a cutoff not below the sphere diameter, so every
+ * pair in contact is listed. If the lists overflowed MAX_NEIGHBORS, some
+ * are truncated, and the neighbors are found in the hashmap instead.
+ */
+__kernel kWorkGroupSize void neighbor_forces(
+    __global float *vel,
+    const __global float *pos,
+    const __global uint *offsets,
+    const __global uint *indices,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys)
+{
+    const uint id = get_global_id(0);
+    if (id >= N_POINTS) {
+        return;
+    }
+
+    float3 force = (float3) (0.0f);
+    if (offsets[N_POINTS] > MAX_NEIGHBORS) {
+        force = cell_forces(id, pos, hashmap, keys);
+    } else {
+        const float3 length = DOMAIN_HI - DOMAIN_LO;
+        const float3 p = vload3(id, pos);
+        const uint end = offsets[id + 1];
+        for (uint i = offsets[id]; i < end; ++i) {
+            float3 d = p - vload3(indices[i], pos);
+            d -= length * rint(d / length);     /* minimum image */
+            force += pair_force(d);
+        }
+    }
+    vstore3(vload3(id, vel) + TIME_STEP * force, id, vel);
+}
+
+#endif /* NEIGHBOR_CUTOFF */
+
+/** ---------------------------------------------------------------------------
+ * Surface extraction, compiled if SURFACE_GRID is defined by the host:
+ *  SURFACE_GRID, SURFACE_RADIUS, SURFACE_ISO, MAX_VERTICES
+ * The density field is sampled on SURFACE_GRID nodes along each axis of the
+ * periodic domain, and voxel (i, j, k) spans nodes (i, j, k) to (i+1, j+1,
+ * k+1), wrapped. Voxel corner c is at offset (c & 1, (c >> 1) & 1, c >> 2),
+ * and edges 0-3, 4-7 and 8-11 lie along x, y and z. A corner is inside the
+ * surface if its density is above SURFACE_ISO. Surface vertices are stored
+ * as interleaved position and normal float triplets.
+ */
+#if defined(SURFACE_GRID)
+
+#define kSurfaceVoxels  (SURFACE_GRID * SURFACE_GRID * SURFACE_GRID)
+
+/** Corner pair of each voxel edge. */
+__constant uchar kEdgeCorners[12][2] = {
+    {0, 1}, {2, 3}, {4, 5}, {6, 7},
+    {0, 2}, {1, 3}, {4, 6}, {5, 7},
+    {0, 4}, {1, 5}, {2, 6}, {3, 7}
+};
+
+/**
+ * Marching cubes tables, indexed by the voxel case, the bit mask of its
+ * inside corners: the number of triangle vertices, and the edges of each
+ * triangle terminated by -1. Triangles are counter-clockwise seen from the
+ * outside. Ambiguous faces always separate the inside corners, so adjacent
+ * voxels agree on their shared face and the surface is closed.
+ */
+__constant uchar kVertexCount[256] = {
+     0,  3,  3,  6,  3,  6,  6,  9,  3,  6,  6,  9,  6,  9,  9,  6,
+     3,  6,  6,  9,  6,  9,  9, 12,  6,  9,  9, 12,  9, 12, 12,  9,
+     3,  6,  6,  9,  6,  9,  9, 12,  6,  9,  9, 12,  9, 12, 12,  9,
+     6,  9,  9,  6,  9, 12, 12,  9,  9, 12, 12,  9, 12, 15, 15,  6,
+     3,  6,  6,  9,  6,  9,  9, 12,  6,  9,  9, 12,  9, 12, 12,  9,
+     6,  9,  9, 12,  9,  6, 12,  9,  9, 12, 12, 15, 12,  9, 15,  6,
+     6,  9,  9, 12,  9, 12, 12, 15,  9, 12, 12, 15, 12, 15, 15, 12,
+     9, 12, 12,  9, 12,  9, 15,  6, 12, 15, 15, 12, 15, 12,  6,  3,
+     3,  6,  6,  9,  6,  9,  9, 12,  6,  9,  9, 12,  9, 12, 12,  9,
+     6,  9,  9, 12,  9, 12, 12, 15,  9, 12, 12, 15, 12, 15, 15, 12,
+     6,  9,  9, 12,  9, 12, 12, 15,  9, 12,  6,  9, 12, 15,  9,  6,
+     9, 12, 12,  9, 12, 15, 15, 12, 12, 15,  9,  6, 15,  6, 12,  3,
+     6,  9,  9, 12,  9, 12, 12, 15,  9, 12, 12, 15,  6,  9,  9,  6,
+     9, 12, 12, 15, 12,  9, 15, 12, 12, 15, 15,  6,  9,  6, 12,  3,
+     9, 12, 12, 15, 12, 15, 15,  6, 12, 15,  9, 12,  9, 12,  6,  3,
+     6,  9,  9,  6,  9,  6, 12,  3,  9, 12,  6,  3,  6,  3,  3,  0
+};
+
+__constant char kTriangleTable[256][16] = {
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 10,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  9,  1,  9,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9, 11,  4, 11,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  8,  5,  8,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11, 10,  0, 10,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 9, 11, 10,  9, 10,  8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  8,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  9,  5,  2,  5,  4,  2,  4,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  2,  1,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 10,  4,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  2,  1,  2,  9,  1,  9,  5, -1, -1, -1, -1},
+    { 5, 11,  1,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  0,  5, 11,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  1,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  9,  4,  9, 11,  4, 11,  1, -1, -1, -1, -1},
+    { 2,  8,  6,  5, 11, 10,  5, 10,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  6,  5,  6,  2,  5,  2,  0, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11, 10,  0, 10,  4,  2,  8,  6, -1, -1, -1, -1},
+    { 2,  9, 11,  2, 11, 10,  2, 10,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  5,  4,  7,  4,  8,  7,  8,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  0,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7,  5,  1, 10,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  2,  1,  2,  7,  1,  7,  5, -1, -1, -1, -1},
+    { 5, 11,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5, 11,  1,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7, 11,  0, 11,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  2,  4,  2,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1},
+    { 7,  9,  2,  5, 11, 10,  5, 10,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  8,  5,  8,  0,  7,  9,  2, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7, 11,  0, 11, 10,  0, 10,  4, -1, -1, -1, -1},
+    { 7, 11, 10,  7, 10,  8,  7,  8,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  9,  8,  7,  8,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  7,  4,  7,  9,  4,  9,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8,  6,  0,  6,  7,  0,  7,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  7,  4,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4,  7,  9,  8,  7,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  7,  1,  7,  9,  1,  9,  0, -1, -1, -1, -1},
+    { 0,  8,  6,  0,  6,  7,  0,  7,  5,  1, 10,  4, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  7,  1,  7,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11,  1,  7,  9,  8,  7,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  7,  4,  7,  9,  4,  9,  0,  5, 11,  1, -1, -1, -1, -1},
+    { 0,  8,  6,  0,  6,  7,  0,  7, 11,  0, 11,  1, -1, -1, -1, -1},
+    { 4,  6,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  4,  7,  9,  8,  7,  8,  6, -1, -1, -1, -1},
+    { 5, 11, 10,  5, 10,  6,  5,  6,  7,  5,  7,  9,  5,  9,  0, -1},
+    { 0,  8,  6,  0,  6,  7,  0,  7, 11,  0, 11, 10,  0, 10,  4, -1},
+    { 7, 11, 10,  7, 10,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6, 10,  3,  4,  8,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  8,  1,  8,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1,  3,  6,  1,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  8,  1,  8,  9,  1,  9,  5, -1, -1, -1, -1},
+    { 5, 11,  1,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5, 11,  1,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  1,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9, 11,  4, 11,  1,  6, 10,  3, -1, -1, -1, -1},
+    { 6,  4,  5,  6,  5, 11,  6, 11,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11,  3,  5,  3,  6,  5,  6,  8,  5,  8,  0, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  3,  0,  3,  6,  0,  6,  4, -1, -1, -1, -1},
+    { 6,  8,  9,  6,  9, 11,  6, 11,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  8, 10,  2, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10,  3,  4,  3,  2,  4,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  2,  8, 10,  2, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  9,  5,  2,  5,  4,  2,  4, 10,  2, 10,  3, -1, -1, -1, -1},
+    { 1,  3,  2,  1,  2,  8,  1,  8,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  2,  1,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1,  3,  2,  1,  2,  8,  1,  8,  4, -1, -1, -1, -1},
+    { 1,  3,  2,  1,  2,  9,  1,  9,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11,  1,  2,  8, 10,  2, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10,  3,  4,  3,  2,  4,  2,  0,  5, 11,  1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  1,  2,  8, 10,  2, 10,  3, -1, -1, -1, -1},
+    { 4, 10,  3,  4,  3,  2,  4,  2,  9,  4,  9, 11,  4, 11,  1, -1},
+    { 2,  8,  4,  2,  4,  5,  2,  5, 11,  2, 11,  3, -1, -1, -1, -1},
+    { 5, 11,  3,  5,  3,  2,  5,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9, 11,  0, 11,  3,  0,  3,  2,  0,  2,  8,  0,  8,  4, -1},
+    { 2,  9, 11,  2, 11,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  9,  2,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  7,  9,  2,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7,  5,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 7,  5,  4,  7,  4,  8,  7,  8,  2,  6, 10,  3, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  4,  7,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  8,  1,  8,  0,  7,  9,  2, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7,  5,  1,  3,  6,  1,  6,  4, -1, -1, -1, -1},
+    { 1,  3,  6,  1,  6,  8,  1,  8,  2,  1,  2,  7,  1,  7,  5, -1},
+    { 5, 11,  1,  7,  9,  2,  6, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5, 11,  1,  7,  9,  2,  6, 10,  3, -1, -1, -1, -1},
+    { 0,  2,  7,  0,  7, 11,  0, 11,  1,  6, 10,  3, -1, -1, -1, -1},
+    { 4,  8,  2,  4,  2,  7,  4,  7, 11,  4, 11,  1,  6, 10,  3, -1},
+    { 7,  9,  2,  6,  4,  5,  6,  5, 11,  6, 11,  3, -1, -1, -1, -1},
+    { 5, 11,  3,  5,  3,  6,  5,  6,  8,  5,  8,  0,  7,  9,  2, -1},
+    { 0,  2,  7,  0,  7, 11,  0, 11,  3,  0,  3,  6,  0,  6,  4, -1},
+    { 7, 11,  3,  7,  3,  6,  7,  6,  8,  7,  8,  2, -1, -1, -1, -1},
+    { 7,  9,  8,  7,  8, 10,  7, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10,  3,  4,  3,  7,  4,  7,  9,  4,  9,  0, -1, -1, -1, -1},
+    { 0,  8, 10,  0, 10,  3,  0,  3,  7,  0,  7,  5, -1, -1, -1, -1},
+    { 7,  5,  4,  7,  4, 10,  7, 10,  3, -1, -1, -1, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  9,  1,  9,  8,  1,  8,  4, -1, -1, -1, -1},
+    { 1,  3,  7,  1,  7,  9,  1,  9,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8,  4,  0,  4,  1,  0,  1,  3,  0,  3,  7,  0,  7,  5, -1},
+    { 1,  3,  7,  1,  7,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5, 11,  1,  7,  9,  8,  7,  8, 10,  7, 10,  3, -1, -1, -1, -1},
+    { 4, 10,  3,  4,  3,  7,  4,  7,  9,  4,  9,  0,  5, 11,  1, -1},
+    { 0,  8, 10,  0, 10,  3,  0,  3,  7,  0,  7, 11,  0, 11,  1, -1},
+    { 4, 10,  3,  4,  3,  7,  4,  7, 11,  4, 11,  1, -1, -1, -1, -1},
+    { 7,  9,  8,  7,  8,  4,  7,  4,  5,  7,  5, 11,  7, 11,  3, -1},
+    { 5, 11,  3,  5,  3,  7,  5,  7,  9,  5,  9,  0, -1, -1, -1, -1},
+    { 0,  8,  4,  7, 11,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 7, 11,  3, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 11,  7,  4,  8,  9,  4,  9,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  0,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 10,  4,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  9,  1,  9,  5,  3, 11,  7, -1, -1, -1, -1},
+    { 5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5,  7,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  3,  0,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9,  7,  4,  7,  3,  4,  3,  1, -1, -1, -1, -1},
+    { 3, 10,  4,  3,  4,  5,  3,  5,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  7,  3,  5,  3, 10,  5, 10,  8,  5,  8,  0, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  3,  0,  3, 10,  0, 10,  4, -1, -1, -1, -1},
+    { 3, 10,  8,  3,  8,  9,  3,  9,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  8,  6,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  0,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  2,  8,  6,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  9,  5,  2,  5,  4,  2,  4,  6,  3, 11,  7, -1, -1, -1, -1},
+    { 1, 10,  4,  2,  8,  6,  3, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  2,  1,  2,  0,  3, 11,  7, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 10,  4,  2,  8,  6,  3, 11,  7, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  2,  1,  2,  9,  1,  9,  5,  3, 11,  7, -1},
+    { 5,  7,  3,  5,  3,  1,  2,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  0,  5,  7,  3,  5,  3,  1, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  3,  0,  3,  1,  2,  8,  6, -1, -1, -1, -1},
+    { 4,  6,  2,  4,  2,  9,  4,  9,  7,  4,  7,  3,  4,  3,  1, -1},
+    { 2,  8,  6,  3, 10,  4,  3,  4,  5,  3,  5,  7, -1, -1, -1, -1},
+    { 5,  7,  3,  5,  3, 10,  5, 10,  6,  5,  6,  2,  5,  2,  0, -1},
+    { 0,  9,  7,  0,  7,  3,  0,  3, 10,  0, 10,  4,  2,  8,  6, -1},
+    { 2,  9,  7,  2,  7,  3,  2,  3, 10,  2, 10,  6, -1, -1, -1, -1},
+    { 3, 11,  9,  3,  9,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  3, 11,  9,  3,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  2,  3,  0,  3, 11,  0, 11,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 11,  5,  3,  5,  4,  3,  4,  8,  3,  8,  2, -1, -1, -1, -1},
+    { 1, 10,  4,  3, 11,  9,  3,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  0,  3, 11,  9,  3,  9,  2, -1, -1, -1, -1},
+    { 0,  2,  3,  0,  3, 11,  0, 11,  5,  1, 10,  4, -1, -1, -1, -1},
+    { 1, 10,  8,  1,  8,  2,  1,  2,  3,  1,  3, 11,  1, 11,  5, -1},
+    { 5,  9,  2,  5,  2,  3,  5,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5,  9,  2,  5,  2,  3,  5,  3,  1, -1, -1, -1, -1},
+    { 0,  2,  3,  0,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  2,  4,  2,  3,  4,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 10,  4,  3,  4,  5,  3,  5,  9,  3,  9,  2, -1, -1, -1, -1},
+    { 5,  9,  2,  5,  2,  3,  5,  3, 10,  5, 10,  8,  5,  8,  0, -1},
+    { 0,  2,  3,  0,  3, 10,  0, 10,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 10,  8,  3,  8,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 11,  9,  3,  9,  8,  3,  8,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  3,  4,  3, 11,  4, 11,  9,  4,  9,  0, -1, -1, -1, -1},
+    { 0,  8,  6,  0,  6,  3,  0,  3, 11,  0, 11,  5, -1, -1, -1, -1},
+    { 3, 11,  5,  3,  5,  4,  3,  4,  6, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 10,  4,  3, 11,  9,  3,  9,  8,  3,  8,  6, -1, -1, -1, -1},
+    { 1, 10,  6,  1,  6,  3,  1,  3, 11,  1, 11,  9,  1,  9,  0, -1},
+    { 0,  8,  6,  0,  6,  3,  0,  3, 11,  0, 11,  5,  1, 10,  4, -1},
+    { 1, 10,  6,  1,  6,  3,  1,  3, 11,  1, 11,  5, -1, -1, -1, -1},
+    { 5,  9,  8,  5,  8,  6,  5,  6,  3,  5,  3,  1, -1, -1, -1, -1},
+    { 4,  6,  3,  4,  3,  1,  4,  1,  5,  4,  5,  9,  4,  9,  0, -1},
+    { 0,  8,  6,  0,  6,  3,  0,  3,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  6,  3,  4,  3,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 3, 10,  4,  3,  4,  5,  3,  5,  9,  3,  9,  8,  3,  8,  6, -1},
+    { 5,  9,  0,  3, 10,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8,  6,  0,  6,  3,  0,  3, 10,  0, 10,  4, -1, -1, -1, -1},
+    { 3, 10,  6, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6, 10, 11,  6, 11,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  6, 10, 11,  6, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  6, 10, 11,  6, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9,  5,  6, 10, 11,  6, 11,  7, -1, -1, -1, -1},
+    { 1, 11,  7,  1,  7,  6,  1,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 11,  7,  1,  7,  6,  1,  6,  8,  1,  8,  0, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 11,  7,  1,  7,  6,  1,  6,  4, -1, -1, -1, -1},
+    { 1, 11,  7,  1,  7,  6,  1,  6,  8,  1,  8,  9,  1,  9,  5, -1},
+    { 5,  7,  6,  5,  6, 10,  5, 10,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  5,  7,  6,  5,  6, 10,  5, 10,  1, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  6,  0,  6, 10,  0, 10,  1, -1, -1, -1, -1},
+    { 4,  8,  9,  4,  9,  7,  4,  7,  6,  4,  6, 10,  4, 10,  1, -1},
+    { 5,  7,  6,  5,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  7,  6,  5,  6,  8,  5,  8,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  6,  0,  6,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 6,  8,  9,  6,  9,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  8, 10,  2, 10, 11,  2, 11,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10, 11,  4, 11,  7,  4,  7,  2,  4,  2,  0, -1, -1, -1, -1},
+    { 0,  9,  5,  2,  8, 10,  2, 10, 11,  2, 11,  7, -1, -1, -1, -1},
+    { 2,  9,  5,  2,  5,  4,  2,  4, 10,  2, 10, 11,  2, 11,  7, -1},
+    { 1, 11,  7,  1,  7,  2,  1,  2,  8,  1,  8,  4, -1, -1, -1, -1},
+    { 1, 11,  7,  1,  7,  2,  1,  2,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  5,  1, 11,  7,  1,  7,  2,  1,  2,  8,  1,  8,  4, -1},
+    { 1, 11,  7,  1,  7,  2,  1,  2,  9,  1,  9,  5, -1, -1, -1, -1},
+    { 5,  7,  2,  5,  2,  8,  5,  8, 10,  5, 10,  1, -1, -1, -1, -1},
+    { 4, 10,  1,  4,  1,  5,  4,  5,  7,  4,  7,  2,  4,  2,  0, -1},
+    { 0,  9,  7,  0,  7,  2,  0,  2,  8,  0,  8, 10,  0, 10,  1, -1},
+    { 4, 10,  1,  2,  9,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 2,  8,  4,  2,  4,  5,  2,  5,  7, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  7,  2,  5,  2,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  9,  7,  0,  7,  2,  0,  2,  8,  0,  8,  4, -1, -1, -1, -1},
+    { 2,  9,  7, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6, 10, 11,  6, 11,  9,  6,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  0,  6, 10, 11,  6, 11,  9,  6,  9,  2, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6, 10,  0, 10, 11,  0, 11,  5, -1, -1, -1, -1},
+    { 6, 10, 11,  6, 11,  5,  6,  5,  4,  6,  4,  8,  6,  8,  2, -1},
+    { 1, 11,  9,  1,  9,  2,  1,  2,  6,  1,  6,  4, -1, -1, -1, -1},
+    { 1, 11,  9,  1,  9,  2,  1,  2,  6,  1,  6,  8,  1,  8,  0, -1},
+    { 0,  2,  6,  0,  6,  4,  0,  4,  1,  0,  1, 11,  0, 11,  5, -1},
+    { 1, 11,  5,  6,  8,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  9,  2,  5,  2,  6,  5,  6, 10,  5, 10,  1, -1, -1, -1, -1},
+    { 4,  8,  0,  5,  9,  2,  5,  2,  6,  5,  6, 10,  5, 10,  1, -1},
+    { 0,  2,  6,  0,  6, 10,  0, 10,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4,  8,  2,  4,  2,  6,  4,  6, 10,  4, 10,  1, -1, -1, -1, -1},
+    { 6,  4,  5,  6,  5,  9,  6,  9,  2, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  9,  2,  5,  2,  6,  5,  6,  8,  5,  8,  0, -1, -1, -1, -1},
+    { 0,  2,  6,  0,  6,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 6,  8,  2, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 8, 10, 11,  8, 11,  9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10, 11,  4, 11,  9,  4,  9,  0, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8, 10,  0, 10, 11,  0, 11,  5, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10, 11,  4, 11,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 11,  9,  1,  9,  8,  1,  8,  4, -1, -1, -1, -1, -1, -1, -1},
+    { 1, 11,  9,  1,  9,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8,  4,  0,  4,  1,  0,  1, 11,  0, 11,  5, -1, -1, -1, -1},
+    { 1, 11,  5, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  9,  8,  5,  8, 10,  5, 10,  1, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10,  1,  4,  1,  5,  4,  5,  9,  4,  9,  0, -1, -1, -1, -1},
+    { 0,  8, 10,  0, 10,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 4, 10,  1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  9,  8,  5,  8,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 5,  9,  0, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    { 0,  8,  4, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+    {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1}
+};
+
+/** Surface grid node index and density field derivatives. */
+uint surface_node(const int3 node);
+float3 surface_gradient(const __global float *density, const int3 node);
+
+/** ---------------------------------------------------------------------------
+ * surface_node
+ * Index of the grid node, with periodic boundary conditions.
+ */
+uint surface_node(const int3 node)
+{
+    const int3 n = (int3) ((int) SURFACE_GRID);
+    int3 w = (node % n + n) % n;
+    return (uint) w.x + SURFACE_GRID * ((uint) w.y + SURFACE_GRID * (uint) w.z);
+}
+
+/**
+ * surface_gradient
+ * Central difference gradient of the density field at the grid node.
+ */
+float3 surface_gradient(const __global float *density, const int3 node)
+{
+    const float3 width = (DOMAIN_HI - DOMAIN_LO) / (float) SURFACE_GRID;
+    float3 g;
+    g.x = density[surface_node(node + (int3) (1, 0, 0))]
+        - density[surface_node(node - (int3) (1, 0, 0))];
+    g.y = density[surface_node(node + (int3) (0, 1, 0))]
+        - density[surface_node(node - (int3) (0, 1, 0))];
+    g.z = density[surface_node(node + (int3) (0, 0, 1))]
+        - density[surface_node(node - (int3) (0, 0, 1))];
+    return g / (2.0f * width);
+}
+
+/** ---------------------------------------------------------------------------
+ * surface_density
+ * Gather the density of each grid node from the points within the splat
+ * radius, with the kernel W = (1 - r^2/R^2)^3. The points are found in the
+ * 27 cells around the node cell, so the radius is not above the cell width.
+ */
+__kernel kWorkGroupSize void surface_density(
+    __global float *density,
+    const __global Cell_t *hashmap,
+    const __global KeyValue_t *keys,
+    const __global float *pos)
+{
+    const uint id = get_global_id(0);
+    if (id >= kSurfaceVoxels) {
+        return;
+    }
+
+    const float3 length = DOMAIN_HI - DOMAIN_LO;
+    const uint3 node = (uint3) (
+        id % SURFACE_GRID,
+        (id / SURFACE_GRID) % SURFACE_GRID,
+        id / (SURFACE_GRID * SURFACE_GRID));
+    const float3 p = DOMAIN_LO + length * convert_float3(node) / (float) SURFACE_GRID;
+    const int3 n = (int3) ((int) N_CELLS);
+    const int3 c = convert_int3(cell_index(p));
+    const float inv_radius_sq = 1.0f / (SURFACE_RADIUS * SURFACE_RADIUS);
+
+    float sum = 0.0f;
+    #pragma unroll
+    for (int z = -1; z <= 1; ++z) {
+        #pragma unroll
+        for (int y = -1; y <= 1; ++y) {
+            #pragma unroll
+            for (int x = -1; x <= 1; ++x) {
+                int3 cell = ((c + (int3) (x, y, z)) % n + n) % n;
+                uint slot = hashmap_find(hashmap, cell_key(convert_uint3(cell)));
+                if (slot == kEmpty) {
+                    continue;
+                }
+
+                const uint end = hashmap[slot].end;
+                for (uint i = hashmap[slot].start; i < end; ++i) {
+                    float3 d = p - vload3(keys[i].value, pos);
+                    d -= length * rint(d / length);     /* minimum image */
+                    float w = fmax(1.0f - dot(d, d) * inv_radius_sq, 0.0f);
+                    sum += w * w * w;
+                }
+            }
+        }
+    }
+
+    density[id] = sum;
+}
+
+/** ---------------------------------------------------------------------------
+ * surface_classify
+ * Compute the case of each voxel, and store its number of triangle vertices
+ * and whether it is crossed by the surface.
+ */
+__kernel kWorkGroupSize void surface_classify(
+    __global uint *counts,
+    __global uint *occupied,
+    const __global float *density)
+{
+    const uint id = get_global_id(0);
+    if (id >= kSurfaceVoxels) {
+        return;
+    }
+
+    const int3 voxel = (int3) (
+        id % SURFACE_GRID,
+        (id / SURFACE_GRID) % SURFACE_GRID,
+        id / (SURFACE_GRID * SURFACE_GRID));
+
+    uint mask = 0;
+    #pragma unroll
+    for (int c = 0; c < 8; ++c) {
+        int3 corner = voxel + (int3) (c & 1, (c >> 1) & 1, c >> 2);
+        if (density[surface_node(corner)] > SURFACE_ISO) {
+            mask |= 1 << c;
+        }
+    }
+
+    const uint count = kVertexCount[mask];
+    counts[id] = count;
+    occupied[id] = (count > 0) ? 1 : 0;
+}
+
+/** ---------------------------------------------------------------------------
+ * surface_generate
+ * Generate the triangles of each active voxel at its scanned vertex offset.
+ * The vertices are interpolated along the voxel edges, with the normals
+ * along the decreasing density gradient. The number of active voxels is
+ * read from the device, so the kernel runs over every voxel and the excess
+ * work-items return. Triangles beyond MAX_VERTICES are dropped.
+ */
+__kernel kWorkGroupSize void surface_generate(
+    __global float *vertices,
+    const __global uint *active,
+    const __global uint *occupied_offsets,
+    const __global uint *vertex_offsets,
+    const __global float *density)
+{
+    const uint id = get_global_id(0);
+    if (id >= occupied_offsets[kSurfaceVoxels]) {
+        return;
+    }
+
+    const uint v = active[id];
+    const int3 voxel = (int3) (
+        v % SURFACE_GRID,
+        (v / SURFACE_GRID) % SURFACE_GRID,
+        v / (SURFACE_GRID * SURFACE_GRID));
+    const float3 width = (DOMAIN_HI - DOMAIN_LO) / (float) SURFACE_GRID;
+
+    /* Sample the voxel corners. */
+    float value[8];
+    uint mask = 0;
+    #pragma unroll
+    for (int c = 0; c < 8; ++c) {
+        int3 corner = voxel + (int3) (c & 1, (c >> 1) & 1, c >> 2);
+        value[c] = density[surface_node(corner)];
+        if (value[c] > SURFACE_ISO) {
+            mask |= 1 << c;
+        }
+    }
+
+    /* Emit the triangles, each vertex on the edge crossing the iso-value. */
+    const uint offset = vertex_offsets[v];
+    const uint count = kVertexCount[mask];
+    for (uint i = 0; i < count; ++i) {
+        if (offset + (i - i % 3) + 3 > MAX_VERTICES) {
+            break;
+        }
+
+        const int edge = kTriangleTable[mask][i];
+        const int a = kEdgeCorners[edge][0];
+        const int b = kEdgeCorners[edge][1];
+        const int3 corner_a = voxel + (int3) (a & 1, (a >> 1) & 1, a >> 2);
+        const int3 corner_b = voxel + (int3) (b & 1, (b >> 1) & 1, b >> 2);
+
+        float t = (SURFACE_ISO - value[a]) / (value[b] - value[a]);
+        float3 p = DOMAIN_LO + width * mix(
+            convert_float3(corner_a),
+            convert_float3(corner_b),
+            t);
+        float3 g = mix(
+            surface_gradient(density, corner_a),
+            surface_gradient(density, corner_b),
+            t);
+
+        vstore3(p, 2 * (offset + i), vertices);
+        vstore3(-normalize(g), 2 * (offset + i) + 1, vertices);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * surface_draw_args
+ * Store the indirect draw arguments of the surface triangles, clamped to
+ * MAX_VERTICES. Runs in a single work-item.
+ */
+__kernel void surface_draw_args(
+    __global DrawArgs_t *args,
+    const __global uint *vertex_offsets)
+{
+    const uint count = min(vertex_offsets[kSurfaceVoxels], (uint) MAX_VERTICES);
+    args->count = count - count % 3;
+    args->instance_count = 1;
+    args->first = 0;
+    args->base_instance = 0;
+}
+
+#endif /* SURFACE_GRID */
@@ -3,11 +3,13 @@
 uniform mat4 u_view;
 uniform mat4 u_persp;
 uniform float u_scale;
+uniform vec3 u_right;                           /* camera view basis */
+uniform vec3 u_up;
+uniform vec3 u_domain_lo;
+uniform vec3 u_domain_size;
 
-layout (location = 0) in vec2 a_sprite_coord;
-layout (location = 1) in vec3 a_point_pos;      /* x, y, z */
-layout (location = 2) in vec3 a_point_col;      /* r, g, b */
-layout (location = 3) in float a_point_radius;
+layout (location = 0) in vec4 a_point_pos;      /* unorm16 x, y, z, radius */
+layout (location = 1) in vec4 a_point_col;      /* r, g, b, a */
 
 out vec2 v_sprite_coord;
 out vec3 v_point_pos;
@@ -18,16 +20,18 @@ out vec3 v_point_col;
  */
 void main(void)
 {
+    /* Sprite corners of the triangle strip, from the vertex id */
+    vec2 sprite_coord = vec2(gl_VertexID & 1, gl_VertexID >> 1);
+
     /* Pass through sprite uv-coordinates and point vertex attributes */
-    v_sprite_coord = a_sprite_coord;
-    v_point_pos = a_point_pos;
-    v_point_col = a_point_col;
+    v_sprite_coord = sprite_coord;
+    v_point_pos = u_domain_lo + u_domain_size * a_point_pos.xyz;
+    v_point_col = a_point_col.rgb;
 
-    /* Compute the vertex from the sprite and point positions */
-    float radius = u_scale * a_point_radius;
-    vec2 sprite_xy = radius * (2.0 * a_sprite_coord - 1.0);
-    vec4 sprite_pos = inverse(u_view) * vec4(sprite_xy, 0.0, 1.0);
-    vec4 point_pos = vec4(a_point_pos, 1.0);
+    /* Compute the vertex in the sprite plane facing the camera */
+    float radius = u_scale * a_point_pos.w;
+    vec2 sprite_xy = radius * (2.0 * sprite_coord - 1.0);
+    vec3 pos = v_point_pos + sprite_xy.x * u_right + sprite_xy.y * u_up;
 
-    gl_Position = u_persp * (u_view * (point_pos +  sprite_pos));
+    gl_Position = u_persp * (u_view * vec4(pos, 1.0));
 }
@@ -0,0 +1,20 @@
+#version 330 core
+
+#define kSurfaceCol vec3(0.3, 0.6, 0.9)
+#define kSurfaceAlpha 0.5
+
+in vec3 v_vertex_normal;
+
+out vec4 frag_col;
+
+/* ----------------------------------------------------------------------------
+ * Fragment shader main
+ */
+void main(void)
+{
+    /* Shade both sides of the surface using a simple directional light. */
+    const vec3 light_dir = normalize(vec3(0.5, 0.5, 1.5));
+    vec3 N = normalize(v_vertex_normal);
+    float diffuse = abs(dot(light_dir, N));
+    frag_col = vec4(kSurfaceCol * (0.2 + 0.8 * diffuse), kSurfaceAlpha);
+}
@@ -0,0 +1,20 @@
+#version 330 core
+
+uniform mat4 u_view;
+uniform mat4 u_persp;
+
+layout (location = 0) in vec3 a_vertex_pos;     /* x, y, z */
+layout (location = 1) in vec3 a_vertex_normal;  /* nx, ny, nz */
+
+out vec3 v_vertex_normal;
+
+/*
+ * vertex shader main
+ */
+void main(void)
+{
+    /* Pass through the normal in view coordinates */
+    v_vertex_normal = mat3(u_view) * a_vertex_normal;
+
+    gl_Position = u_persp * (u_view * vec4(a_vertex_pos, 1.0));
+}
@@ -0,0 +1,247 @@
+/*
+ * device.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <iostream>
+#include "device.hpp"
+using namespace atto;
+
+/* Returned by the ICD loader when no platform is installed, cl_khr_icd. */
+#ifndef CL_PLATFORM_NOT_FOUND_KHR
+#define CL_PLATFORM_NOT_FOUND_KHR -1001
+#endif
+
+/**
+ * Entry
+ * Device with its platform, in platform order.
+ */
+struct Entry {
+    cl_platform_id platform;
+    cl_device_id device;
+};
+
+/**
+ * get_entries
+ * Enumerate the devices of every platform. No installed platform and a
+ * platform without devices are the only errors expected, any other aborts.
+ */
+static std::vector<Entry> get_entries(void)
+{
+    cl_uint n_platforms = 0;
+    cl_int err = clGetPlatformIDs(0, NULL, &n_platforms);
+    if (err == CL_PLATFORM_NOT_FOUND_KHR || n_platforms == 0) {
+        return {};
+    }
+    core_assert(err == CL_SUCCESS, "clGetPlatformIDs");
+    std::vector<cl_platform_id> platforms(n_platforms);
+    err = clGetPlatformIDs(n_platforms, platforms.data(), NULL);
+    core_assert(err == CL_SUCCESS, "clGetPlatformIDs");
+
+    std::vector<Entry> entries;
+    for (auto &platform : platforms) {
+        cl_uint n_devices = 0;
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &n_devices);
+        if (err == CL_DEVICE_NOT_FOUND) {
+            continue;
+        }
+        core_assert(err == CL_SUCCESS, "clGetDeviceIDs");
+        std::vector<cl_device_id> devices(n_devices);
+        err = clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, n_devices, devices.data(), NULL);
+        core_assert(err == CL_SUCCESS, "clGetDeviceIDs");
+        for (auto &device : devices) {
+            entries.push_back({platform, device});
+        }
+    }
+    return entries;
+}
+
+/**
+ * get_platform_name
+ * Return the platform name.
+ */
+static std::string get_platform_name(const cl_platform_id &platform)
+{
+    size_t size = 0;
+    cl_int err = clGetPlatformInfo(platform, CL_PLATFORM_NAME, 0, NULL, &size);
+    core_assert(err == CL_SUCCESS, "clGetPlatformInfo");
+    std::string name(size, '\0');
+    err = clGetPlatformInfo(platform, CL_PLATFORM_NAME, size, &name[0], NULL);
+    core_assert(err == CL_SUCCESS, "clGetPlatformInfo");
+    return name.c_str();
+}
+
+/**
+ * get_device_string
+ * Return a device info string parameter.
+ */
+static std::string get_device_string(
+    const cl_device_id &device,
+    const cl_device_info param)
+{
+    size_t size = 0;
+    cl_int err = clGetDeviceInfo(device, param, 0, NULL, &size);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    std::string str(size, '\0');
+    err = clGetDeviceInfo(device, param, size, &str[0], NULL);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    return str.c_str();
+}
+
+/**
+ * get_device_type
+ * Return the device type.
+ */
+static cl_device_type get_device_type(const cl_device_id &device)
+{
+    cl_device_type type = 0;
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    return type;
+}
+
+/**
+ * get_type_name
+ * Return the name of a device type.
+ */
+static const char *get_type_name(const cl_device_type type)
+{
+    if (type & CL_DEVICE_TYPE_GPU) {
+        return "gpu";
+    } else if (type & CL_DEVICE_TYPE_CPU) {
+        return "cpu";
+    } else if (type & CL_DEVICE_TYPE_ACCELERATOR) {
+        return "accelerator";
+    }
+    return "other";
+}
+
+/**
+ * matches
+ * Does the device entry match the platform, type and name of the query?
+ */
+static bool matches(const Entry &entry, const DeviceQuery &query)
+{
+    if ((get_device_type(entry.device) & query.type) == 0) {
+        return false;
+    }
+    if (get_platform_name(entry.platform).find(query.platform) == std::string::npos) {
+        return false;
+    }
+    if (get_device_string(entry.device, CL_DEVICE_NAME).find(query.name) == std::string::npos) {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * parse_device_type
+ * Parse a device type name, or return 0 if the name is unknown.
+ */
+cl_device_type parse_device_type(const std::string &name)
+{
+    if (name == "all") {
+        return CL_DEVICE_TYPE_ALL;
+    } else if (name == "cpu") {
+        return CL_DEVICE_TYPE_CPU;
+    } else if (name == "gpu") {
+        return CL_DEVICE_TYPE_GPU;
+    } else if (name == "accelerator") {
+        return CL_DEVICE_TYPE_ACCELERATOR;
+    } else if (name == "default") {
+        return CL_DEVICE_TYPE_DEFAULT;
+    }
+    return 0;
+}
+
+/**
+ * has_extension
+ * Does the device support the extension?
+ */
+bool has_extension(const cl_device_id &device, const std::string &name)
+{
+    std::string extensions = get_device_string(device, CL_DEVICE_EXTENSIONS);
+    return extensions.find(name) != std::string::npos;
+}
+
+/**
+ * has_gl_sharing
+ * Does the device support the khr or the apple OpenGL sharing extension?
+ */
+bool has_gl_sharing(const cl_device_id &device)
+{
+    return has_extension(device, "cl_khr_gl_sharing") ||
+           has_extension(device, "cl_APPLE_gl_sharing");
+}
+
+/**
+ * list_devices
+ * Print the available devices. The index is the one selected by a query
+ * with no platform, type or name.
+ */
+void list_devices(std::ostream &os)
+{
+    std::vector<Entry> entries = get_entries();
+    if (entries.empty()) {
+        os << "no OpenCL devices\n";
+        return;
+    }
+
+    for (size_t i = 0; i < entries.size(); ++i) {
+        const Entry &entry = entries[i];
+        os << "[" << i << "] "
+           << get_platform_name(entry.platform) << ": "
+           << get_device_string(entry.device, CL_DEVICE_NAME)
+           << " (" << get_type_name(get_device_type(entry.device))
+           << ", " << get_device_string(entry.device, CL_DEVICE_VERSION)
+           << ", gl sharing " << (has_gl_sharing(entry.device) ? "yes" : "no")
+           << ")\n";
+    }
+}
+
+/**
+ * select_device
+ * Select the device matching the query, or abort listing the available
+ * devices if none does.
+ */
+cl_device_id select_device(const DeviceQuery &query)
+{
+    std::vector<cl_device_id> devices;
+    for (auto &entry : get_entries()) {
+        if (matches(entry, query)) {
+            devices.push_back(entry.device);
+        }
+    }
+
+    /* Select by index among the matching devices. */
+    if (query.index >= 0) {
+        if ((size_t) query.index >= devices.size()) {
+            std::cerr << "device index " << query.index << " out of range, "
+                      << devices.size() << " matching devices\n";
+            list_devices(std::cerr);
+        }
+        core_assert((size_t) query.index < devices.size(), "device index overflow");
+        return devices[query.index];
+    }
+
+    /* Otherwise, prefer a device sharing OpenGL buffers. */
+    if (devices.empty()) {
+        std::cerr << "no matching device\n";
+        list_devices(std::cerr);
+    }
+    core_assert(!devices.empty(), "no matching device");
+    if (query.gl_sharing) {
+        for (auto &device : devices) {
+            if (has_gl_sharing(device)) {
+                return device;
+            }
+        }
+    }
+    return devices[0];
+}
@@ -0,0 +1,50 @@
+/*
+ * device.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef DEVICE_H_
+#define DEVICE_H_
+
+#include <ostream>
+#include <string>
+#include <vector>
+#include "atto/opencl/opencl.hpp"
+
+/**
+ * DeviceQuery
+ * OpenCL device selection by platform name, device type, device name and
+ * index among the matching devices, in platform order. Names match as
+ * substrings, empty names match any.
+ */
+struct DeviceQuery {
+    std::string platform;                       /* platform name substring */
+    cl_device_type type = CL_DEVICE_TYPE_ALL;   /* device type mask */
+    std::string name;                           /* device name substring */
+    long index = -1;                            /* matching device index */
+    bool gl_sharing = true;                     /* share OpenGL buffers */
+};
+
+/* Parse a device type name: all, cpu, gpu, accelerator or default. */
+cl_device_type parse_device_type(const std::string &name);
+
+/* Does the device support the extension? */
+bool has_extension(const cl_device_id &device, const std::string &name);
+
+/* Does the device support sharing buffers with OpenGL? */
+bool has_gl_sharing(const cl_device_id &device);
+
+/* Print the available devices with their platform, type and index. */
+void list_devices(std::ostream &os);
+
+/* Select the device matching the query. Without an index, prefer the first
+ * device supporting OpenGL sharing if gl_sharing is set. */
+cl_device_id select_device(const DeviceQuery &query);
+
+#endif /* DEVICE_H_ */
@@ -0,0 +1,193 @@
+/*
+ * loader.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "loader.hpp"
+using namespace atto;
+
+/**
+ * ply_type_size
+ * Return the size of a PLY scalar type, or 0 if the type is unknown.
+ */
+static size_t ply_type_size(const std::string &type)
+{
+    if (type == "char" || type == "uchar" || type == "int8" || type == "uint8") {
+        return 1;
+    } else if (type == "short" || type == "ushort" || type == "int16" || type == "uint16") {
+        return 2;
+    } else if (type == "int" || type == "uint" || type == "int32" || type == "uint32" ||
+               type == "float" || type == "float32") {
+        return 4;
+    } else if (type == "double" || type == "float64") {
+        return 8;
+    }
+    return 0;
+}
+
+/**
+ * parse_ply_header
+ * Parse the PLY header, up to end_header, into the vertex layout of the
+ * point file. Elements after the vertex element are ignored.
+ */
+static void parse_ply_header(PointFile &file)
+{
+    const char *begin = (const char *) file.m_data;
+
+    /* Find the end of the header. */
+    static const char end_header[] = "end_header\n";
+    const char *last = begin + file.m_size;
+    const char *it = std::search(begin, last, end_header, end_header + sizeof(end_header) - 1);
+    core_assert(it != last, "PLY header without end_header");
+    file.m_offset = (it - begin) + sizeof(end_header) - 1;
+
+    std::istringstream header(std::string(begin, it));
+    std::string line;
+    bool format = false;
+    size_t n_elements = 0;
+    bool vertex = false;                        /* in the vertex element */
+    bool has_xyz[3] = {false, false, false};
+    while (std::getline(header, line)) {
+        std::istringstream ss(line);
+        std::string keyword;
+        ss >> keyword;
+
+        if (keyword == "format") {
+            std::string value;
+            ss >> value;
+            core_assert(value == "binary_little_endian", "PLY format must be binary_little_endian");
+            format = true;
+        } else if (keyword == "element") {
+            std::string name;
+            size_t count = 0;
+            ss >> name >> count;
+            vertex = (n_elements++ == 0);
+            if (vertex) {
+                core_assert(name == "vertex", "PLY vertex element must come first");
+                file.m_count = count;
+            }
+        } else if (keyword == "property" && vertex) {
+            std::string type, name;
+            ss >> type >> name;
+            core_assert(type != "list", "PLY vertex list properties are unsupported");
+            size_t size = ply_type_size(type);
+            core_assert(size > 0, "unknown PLY property type");
+            for (size_t i = 0; i < 3; ++i) {
+                if (name == std::string(1, "xyz"[i])) {
+                    core_assert(type == "float" || type == "float32",
+                        "PLY coordinates must be float");
+                    file.m_xyz[i] = file.m_stride;
+                    has_xyz[i] = true;
+                }
+            }
+            file.m_stride += size;
+        }
+    }
+
+    core_assert(format, "PLY header without format");
+    core_assert(has_xyz[0] && has_xyz[1] && has_xyz[2], "PLY vertex without x, y and z");
+    core_assert(file.m_offset + file.m_count * file.m_stride <= file.m_size,
+        "PLY file truncated");
+}
+
+/** ---------------------------------------------------------------------------
+ * PointFile::PointFile
+ * @brief Map the point file and parse its layout. Files starting with the PLY
+ * magic are PLY files, others are packed float xyz triplets.
+ */
+PointFile::PointFile(const std::string &filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    core_assert(fd >= 0, "failed to open point file");
+
+    struct stat st;
+    int err = fstat(fd, &st);
+    core_assert(err == 0 && st.st_size > 0, "empty point file");
+    m_size = st.st_size;
+
+    /* The mapping is read once front to back, while it is streamed. */
+    void *data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    core_assert(data != MAP_FAILED, "failed to map point file");
+    madvise(data, m_size, MADV_SEQUENTIAL);
+    m_data = (const cl_uchar *) data;
+
+    static const char magic[] = "ply\n";
+    if (m_size >= 4 && std::memcmp(m_data, magic, 4) == 0) {
+        parse_ply_header(*this);
+    } else {
+        core_assert(m_size % (3 * sizeof(cl_float)) == 0,
+            "binary point file size is not a multiple of an xyz triplet");
+        m_count = m_size / (3 * sizeof(cl_float));
+        m_offset = 0;
+        m_stride = 3 * sizeof(cl_float);
+        m_xyz[0] = 0;
+        m_xyz[1] = sizeof(cl_float);
+        m_xyz[2] = 2 * sizeof(cl_float);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * PointFile::~PointFile
+ * @brief Unmap the point file.
+ */
+PointFile::~PointFile()
+{
+    if (m_data != nullptr) {
+        munmap((void *) m_data, m_size);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * PointFile::is_packed
+ * @brief Are the points packed xyz triplets in the device layout, aligned
+ * for float access?
+ */
+bool PointFile::is_packed(void) const
+{
+    return m_stride == 3 * sizeof(cl_float) &&
+           m_xyz[0] == 0 &&
+           m_xyz[1] == sizeof(cl_float) &&
+           m_xyz[2] == 2 * sizeof(cl_float) &&
+           m_offset % sizeof(cl_float) == 0;
+}
+
+/** ---------------------------------------------------------------------------
+ * PointFile::packed
+ * @brief Pointer to the packed xyz triplet of the point.
+ */
+const cl_float *PointFile::packed(const size_t first) const
+{
+    core_assert(is_packed(), "point file is not packed");
+    return (const cl_float *) (m_data + m_offset) + 3 * first;
+}
+
+/** ---------------------------------------------------------------------------
+ * PointFile::gather
+ * @brief Gather the xyz triplets of count points from the first. The
+ * coordinates may be unaligned in the mapping, so they are copied bytewise.
+ */
+void PointFile::gather(cl_float *out, const size_t first, const size_t count) const
+{
+    core_assert(first + count <= m_count, "point file overflow");
+    const cl_uchar *vertex = m_data + m_offset + first * m_stride;
+    for (size_t i = 0; i < count; ++i) {
+        for (size_t k = 0; k < 3; ++k) {
+            std::memcpy(&out[3 * i + k], vertex + m_xyz[k], sizeof(cl_float));
+        }
+        vertex += m_stride;
+    }
+}
@@ -0,0 +1,50 @@
+/*
+ * loader.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include <string>
+#include "atto/opencl/opencl.hpp"
+
+/**
+ * PointFile
+ * Read-only memory map of a point file. A binary point file holds packed
+ * float xyz triplets, the device layout, and is streamed to the device
+ * straight from the mapping. A PLY file is binary little-endian with the
+ * vertex element first, and float x, y and z properties among fixed size
+ * vertex properties, which are gathered into xyz triplets.
+ */
+struct PointFile {
+    const cl_uchar *m_data = nullptr;           /* mapped file */
+    size_t m_size = 0;                          /* file size in bytes */
+    size_t m_count = 0;                         /* number of points */
+    size_t m_offset = 0;                        /* first vertex in bytes */
+    size_t m_stride = 0;                        /* vertex size in bytes */
+    size_t m_xyz[3] = {0, 0, 0};                /* coordinate offsets */
+
+    /* Are the points packed xyz triplets in the device layout? */
+    bool is_packed(void) const;
+
+    /* Pointer to the packed xyz triplet of the point. */
+    const cl_float *packed(const size_t first) const;
+
+    /* Gather the xyz triplets of count points from the first. */
+    void gather(cl_float *out, const size_t first, const size_t count) const;
+
+    explicit PointFile(const std::string &filename);
+    ~PointFile();
+
+    PointFile(const PointFile &) = delete;
+    PointFile &operator=(const PointFile &) = delete;
+};
+
+#endif /* LOADER_H_ */
@@ -9,30 +9,56 @@
  * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
  */
 
+#include <cctype>
+#include <chrono>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
 #include "model.hpp"
 using namespace atto;
 
 /**
- * main test client
+ * benchmark
+ * Run the model headless for n_frames, one dynamics step per frame, and
+ * report the throughput in particle-steps per second and the profile of
+ * each stage.
  */
-int main(int argc, char const *argv[])
+static void benchmark(const DeviceQuery &query, const size_t n_frames)
 {
-    /* Setup renderer OpenGL context and initialize the GLFW library. */
-    gl::Renderer::init(
-        Params::window_width,
-        Params::window_height,
-        Params::window_title);
-    gl::Renderer::enable_event(
-        gl::Event::FramebufferSize |
-        gl::Event::WindowClose     |
-        gl::Event::Key);
+    Model model(query, true);
 
-    /*
-     * Render loop:
-     *  poll and handle events
-     *  update, draw and swap buffers
-     */
-    Model model;
+    auto begin = std::chrono::steady_clock::now();
+    for (size_t frame = 0; frame < n_frames; ++frame) {
+        model.execute();
+    }
+    if (!Params::cpu_backend) {
+        cl::Queue::finish(model.m_queue);
+    }
+    auto end = std::chrono::steady_clock::now();
+    model.m_profiler.collect(true);
+
+    std::chrono::duration<double> elapsed = end - begin;
+    double seconds = elapsed.count();
+
+    std::cout << std::fixed << std::setprecision(3);
+    std::cout << "frames " << n_frames
+              << " points " << Params::n_points
+              << " seconds " << seconds << "\n";
+    std::cout << "frames/s " << n_frames / seconds << "\n";
+    std::cout << "particle-steps/s " << n_frames * Params::n_points / seconds << "\n";
+    std::cout << model.m_profiler.to_string();
+}
+
+/**
+ * render
+ * Render loop:
+ *  poll and handle events
+ *  update, draw and swap buffers
+ * The model is scoped to the loop, so its destructor runs on return.
+ */
+static void render(const DeviceQuery &query)
+{
+    Model model(query);
     gl::Timer timer;
     while (gl::Renderer::is_open()) {
         /* Poll events and handle. */
@@ -72,6 +98,133 @@ int main(int argc, char const *argv[])
             }
         }
     }
+}
+
+/**
+ * usage
+ * Print the command line options.
+ */
+static void usage(const char *name)
+{
+    std::cerr << "usage: " << name << " [options]\n"
+              << "  --headless [n_frames]   run the benchmark without OpenGL\n"
+              << "  --list-devices          list the OpenCL devices\n"
+              << "  --platform <name>       select a platform by name\n"
+              << "  --device-type <type>    all, cpu, gpu, accelerator or default\n"
+              << "  --device-name <name>    select a device by name\n"
+              << "  --device <index>        select a matching device by index\n"
+              << "  --no-gl-sharing         read the points back for drawing\n"
+              << "  --config <file>         set the model parameters in a file\n"
+              << "  --<param> <value>       set a model parameter: n_points,\n"
+              << "                          n_cells, load_factor, domain_lo,\n"
+              << "                          domain_hi, points_file, seed,\n"
+              << "                          time_step, stiffness, diameter,\n"
+              << "                          surface_grid, surface_radius,\n"
+              << "                          surface_iso, neighbor_cutoff,\n"
+              << "                          neighbor_skin, work_group_size,\n"
+              << "                          pipeline_depth, backend (opencl or cpu),\n"
+              << "                          check_interval, trajectory_file,\n"
+              << "                          trajectory_interval or\n"
+              << "                          trajectory_format (float or unorm16)\n";
+}
 
+/**
+ * parse_count
+ * Parse the whole value of an option as a non-negative integer, or report
+ * the option, print the usage and exit if it is invalid or out of range.
+ */
+static size_t parse_count(
+    const char *name,
+    const std::string &option,
+    const std::string &value)
+{
+    try {
+        size_t pos = 0;
+        if (!value.empty() && std::isdigit(value[0])) {
+            unsigned long v = std::stoul(value, &pos);
+            if (pos == value.size() && v <= (unsigned long) std::numeric_limits<long>::max()) {
+                return v;
+            }
+        }
+    } catch (const std::logic_error &) {
+    }
+    std::cerr << "invalid value '" << value << "' of option " << option << "\n";
+    usage(name);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ * main test client
+ */
+int main(int argc, char const *argv[])
+{
+    /*
+     * Parse the command line options.
+     */
+    DeviceQuery query;
+    bool headless = false;
+    size_t n_frames = Params::benchmark_frames;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        bool has_value = i + 1 < argc;
+
+        if (arg == "--headless") {
+            headless = true;
+            if (has_value && std::isdigit(argv[i + 1][0])) {
+                n_frames = parse_count(argv[0], arg, argv[++i]);
+            }
+        } else if (arg == "--list-devices") {
+            list_devices(std::cout);
+            exit(EXIT_SUCCESS);
+        } else if (arg == "--platform" && has_value) {
+            query.platform = argv[++i];
+        } else if (arg == "--device-type" && has_value) {
+            query.type = parse_device_type(argv[++i]);
+            if (query.type == 0) {
+                usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (arg == "--device-name" && has_value) {
+            query.name = argv[++i];
+        } else if (arg == "--device" && has_value) {
+            query.index = parse_count(argv[0], arg, argv[++i]);
+        } else if (arg == "--no-gl-sharing") {
+            query.gl_sharing = false;
+        } else if (arg == "--config" && has_value) {
+            Params::load(argv[++i]);
+        } else if (arg.compare(0, 2, "--") == 0 && has_value &&
+                   Params::set(arg.substr(2), argv[i + 1])) {
+            ++i;
+        } else {
+            usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    Params::update();
+
+    /*
+     * Headless benchmark mode:
+     *  surf.out --headless [n_frames]
+     */
+    if (headless) {
+        benchmark(query, n_frames);
+        exit(EXIT_SUCCESS);
+    }
+
+    /* Setup renderer OpenGL context and initialize the GLFW library. */
+    gl::Renderer::init(
+        Params::window_width,
+        Params::window_height,
+        Params::window_title);
+    gl::Renderer::enable_event(
+        gl::Event::FramebufferSize |
+        gl::Event::WindowClose     |
+        gl::Event::Key);
+
+    /*
+     * Render loop. The model is destroyed on return, so the pending frames
+     * are written out and the writer thread is joined before the exit.
+     */
+    render(query);
     exit(EXIT_SUCCESS);
 }
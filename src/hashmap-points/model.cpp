@@ -9,46 +9,155 @@
  * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
  */
 
+#include <cstddef>
+#include <cstring>
+#include <iterator>
+#include <random>
 #include "model.hpp"
+#include "cpu.hpp"
+#include "loader.hpp"
+#include "program.hpp"
+#include "writer.hpp"
 using namespace atto;
 
+/**
+ * has_draw_indirect
+ * Return true if the OpenGL context draws from indirect arguments in a
+ * buffer, by OpenGL 4.0 or ARB_draw_indirect.
+ */
+static bool has_draw_indirect(void)
+{
+    GLint major = 0;
+    glGetIntegerv(GL_MAJOR_VERSION, &major);
+    if (major >= 4) {
+        return true;
+    }
+
+    GLint n_extensions = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &n_extensions);
+    for (GLint i = 0; i < n_extensions; ++i) {
+        const GLubyte *name = glGetStringi(GL_EXTENSIONS, i);
+        if (name != NULL && std::strcmp((const char *) name, "GL_ARB_draw_indirect") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
 /** ---------------------------------------------------------------------------
  * Model::Model
  * @brief Create OpenCL context and associated objects.
+ * The point data lives in plain device buffers. Each frame writes it into
+ * one of pipeline_depth sets of vertex buffers, by a device copy with OpenGL
+ * sharing, or by a readback without, while OpenGL draws the set of the
+ * previous frame. A headless model has no OpenGL data and runs on any
+ * OpenCL device. The cpu backend runs on the host point data, without
+ * OpenCL. The surface is extracted into the shared vertex buffers, so it is
+ * enabled with OpenGL sharing, or in headless runs to measure its cost.
  */
-Model::Model()
+Model::Model(const DeviceQuery &query, bool headless)
+    : m_headless(headless)
+    , m_profiler(
+        {"acquire",
+         "update points",
+         "sort",
+         "hashmap build",
+         "reorder",
+         "query",
+         "compute forces",
+         "surface",
+         "cull",
+         "release",
+         "vertices",
+         "snapshot",
+         "neighbors"},
+        Params::profile_samples,
+        Params::profiling || headless)
 {
     /*
      * Setup Model data.
      */
     {
-        /* Generate n_points randomly distributed inside the domain */
-        math::rng::Kiss kiss(true);             /* rng engine */
-        math::rng::uniform<cl_float> rand;      /* rng sampler */
-
-        m_points.clear();
-        for (size_t i = 0; i < Params::n_points; ++i) {
-            m_points.push_back({
-                /* point coordinates */
-                rand(kiss, Params::domain_lo.s[0], Params::domain_hi.s[0]),
-                rand(kiss, Params::domain_lo.s[1], Params::domain_hi.s[1]),
-                rand(kiss, Params::domain_lo.s[2], Params::domain_hi.s[2]),
-                /* point color */
-                0.0f,
-                0.0f,
-                0.0f,
-                /* point radius*/
-                1.0f});
+        /* Create the host pipeline, to run the model or check the device. */
+        if (Params::cpu_backend || Params::check_interval > 0) {
+            m_cpu.reset(new CpuBackend);
+        }
+
+        /*
+         * Map the point file, or generate n_points randomly distributed
+         * inside the domain. The device streams the points straight from
+         * the mapped file, or generates them in place, so only the cpu
+         * backend makes the points on the host. Points outside the domain
+         * are wrapped into it by the first step.
+         */
+        if (!Params::points_file.empty()) {
+            m_file.reset(new PointFile(Params::points_file));
+            core_assert(m_file->m_count == Params::n_points, "point file changed");
+            if (Params::cpu_backend) {
+                m_point_pos.resize(3 * Params::n_points);
+                m_file->gather(&m_point_pos[0], 0, Params::n_points);
+            }
+        } else if (Params::cpu_backend) {
+            m_cpu->random_points(m_point_pos, Params::seed);
+        }
+
+        /*
+         * The other point data is uniform, so it is filled on the device,
+         * and the host copies are made for the cpu backend.
+         */
+        if (Params::cpu_backend) {
+            /* point color, white */
+            m_point_col.assign(Params::n_points, cl_uchar4{{255, 255, 255, 255}});
+
+            /* point radius, 0.1 in unorm8 */
+            m_point_radius.assign(Params::n_points, 26);
+
+            /* point velocity, at rest */
+            m_point_vel.assign(3 * Params::n_points, 0.0f);
+
+            /* packed point vertices */
+            m_point_vertices.resize(Params::n_points);
         }
 
+        /* Initialize hashmap stats readbacks */
+        m_readbacks.resize(Params::n_readbacks, Readback{{}, 0, NULL});
+
         /* Initialize prope */
         m_probe = {};
+        m_probe.radius = Params::probe_radius;
+    }
+
+    /*
+     * Select the OpenCL device. The OpenGL point buffers are shared with
+     * OpenCL only if the device supports it.
+     */
+    if (!Params::cpu_backend) {
+        m_device = select_device(query);
+        m_interop = !m_headless && query.gl_sharing && has_gl_sharing(m_device);
+        m_gl_event = m_interop && has_extension(m_device, "cl_khr_gl_event");
+        m_surface = Params::surface_grid > 0 && (m_interop || m_headless);
+        m_cull = m_interop && Params::frustum_culling;
+        m_neighbors = Params::neighbor_cutoff > 0.0f;
+    }
+
+    /*
+     * The surface and the culled points are drawn with the vertex counts
+     * written by OpenCL, which needs indirect draws. Without them, the
+     * surface is disabled and every point is drawn with a host count.
+     */
+    if (!m_headless) {
+        m_gl.draw_indirect = has_draw_indirect();
+        if (!m_gl.draw_indirect && (m_surface || m_cull)) {
+            std::cout << "no OpenGL indirect draws, surface and culling disabled\n";
+            m_surface = false;
+            m_cull = false;
+        }
     }
 
     /*
      * Setup OpenGL data.
      */
-    {
+    if (!m_headless) {
         /* Setup camera view matrix. */
         m_gl.camera.lookat(
             math::vec3f{0.0f, 0.0f, 2.0f},
@@ -56,54 +165,49 @@ Model::Model()
             math::vec3f{0.0f, 1.0f, 0.0f});
 
         /*
-         * Create buffer storage for vertex data with layout:
-         * {(xyz,rgb,scale)_1, (xyz,rgb,scale)_2, ...}
+         * Create buffer storage for the packed point vertices:
+         * {(xyzr, rgba)_1, (xyzr, rgba)_2, ...}
+         * One set of buffers is drawn while OpenCL writes the next frame into
+         * another. The cpu backend updates a single set. The sets are drawn
+         * once written, so they are created without data.
          */
-        m_gl.point_vbo = gl::create_buffer(
-            GL_ARRAY_BUFFER,
-            7 * Params::n_points * sizeof(GLfloat),
-            GL_STREAM_DRAW);
+        m_gl.n_sets = Params::cpu_backend ? 1 : Params::pipeline_depth;
+        for (size_t set = 0; set < m_gl.n_sets; ++set) {
+            m_gl.point_vbo[set] = gl::create_buffer(
+                GL_ARRAY_BUFFER,
+                Params::n_points * sizeof(PointVertex),
+                GL_DYNAMIC_DRAW);
+        }
 
         /*
-         * Create buffer storage for sprite vertex data with layout:
-         * {(uv)_1, (uv)_2, ...}
+         * Create the indirect draw arguments of the point sprites, with every
+         * point drawn. With frustum culling, OpenCL writes the visible points
+         * into the vertex buffers and their count into the draw arguments.
+         * Without indirect draws, the arguments are still shared with OpenCL
+         * but unused, so they are bound to the generic copy target.
          */
-        m_gl.sprite_vertex = std::vector<GLfloat>{
-            0.0f,  0.0f,                        /* bottom left */
-            1.0f,  0.0f,                        /* bottom right */
-            0.0f,  1.0f,                        /* top left */
-            1.0f,  1.0f};                       /* top right */
-
-        m_gl.sprite_index = std::vector<GLuint>{
-            0, 1, 2,                            /* first triangle */
-            3, 2, 1};                           /* second triangle */
-
-        m_gl.sprite_vbo = gl::create_buffer(
-            GL_ARRAY_BUFFER,
-            m_gl.sprite_vertex.size() * sizeof(GLfloat),
-            GL_STATIC_DRAW);
-        glBindBuffer(GL_ARRAY_BUFFER, m_gl.sprite_vbo);
-        glBufferSubData(
-            GL_ARRAY_BUFFER,                            /* target binding point */
-            0,                                          /* offset in data store */
-            m_gl.sprite_vertex.size() * sizeof(GLfloat),/* data store size in bytes */
-            m_gl.sprite_vertex.data());                 /* pointer to data source */
-        glBindBuffer(GL_ARRAY_BUFFER, 0);
-
-        m_gl.sprite_ebo = gl::create_buffer(
-            GL_ELEMENT_ARRAY_BUFFER,
-            m_gl.sprite_index.size() * sizeof(GLuint),
-            GL_STATIC_DRAW);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.sprite_ebo);
-        glBufferSubData(
-            GL_ELEMENT_ARRAY_BUFFER,                    /* target binding point */
-            0,                                          /* offset in data store */
-            m_gl.sprite_index.size() * sizeof(GLuint),  /* data store size in bytes */
-            m_gl.sprite_index.data());                  /* pointer to data source */
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+        const GLenum args_target = m_gl.draw_indirect
+            ? GL_DRAW_INDIRECT_BUFFER : GL_COPY_WRITE_BUFFER;
+        const DrawArgs point_args = {
+            4,                                  /* triangle strip per sprite */
+            Params::n_points, 0, 0};
+        for (size_t set = 0; set < m_gl.n_sets; ++set) {
+            m_gl.point_args[set] = gl::create_buffer(
+                args_target,
+                sizeof(DrawArgs),
+                GL_DYNAMIC_DRAW);
+            glBindBuffer(args_target, m_gl.point_args[set]);
+            glBufferSubData(
+                args_target,                            /* target binding point */
+                0,                                      /* offset in data store */
+                sizeof(DrawArgs),                       /* data store size in bytes */
+                &point_args);                           /* pointer to data source */
+        }
+        glBindBuffer(args_target, 0);
 
         /*
-         * Create shader program object.
+         * Create shader program object. The sprite corners are generated
+         * from the vertex id, so there are no sprite buffers.
          */
         std::vector<GLuint> shaders{
             gl::create_shader(GL_VERTEX_SHADER, "data/hashmap-points.vert"),
@@ -112,96 +216,175 @@ Model::Model()
         std::cout << gl::get_program_info(m_gl.program) << "\n";
 
         /*
-         * Create vertex array object.
+         * Create a vertex array object for each set of point buffers.
          */
-        m_gl.vao = gl::create_vertex_array();
-        glBindVertexArray(m_gl.vao);
-
-        /* Set point sprite vertex data format. */
-        glBindBuffer(GL_ARRAY_BUFFER, m_gl.sprite_vbo);
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, m_gl.sprite_ebo);
-        gl::enable_attribute(m_gl.program, "a_sprite_coord");
-        gl::attribute_pointer(
-            m_gl.program,
-            "a_sprite_coord",
-            GL_FLOAT_VEC2,
-            2*sizeof(GLfloat),  /* byte offset between consecutive attributes */
-            0,                  /* byte offset of first element in the buffer */
-            false);             /* normalized flag */
-
-        /* Set point vertex data format. */
-        glBindBuffer(GL_ARRAY_BUFFER, m_gl.point_vbo);
-        gl::enable_attribute(m_gl.program, "a_point_pos");
-        gl::attribute_pointer(
-            m_gl.program,
-            "a_point_pos",
-            GL_FLOAT_VEC3,
-            7*sizeof(GLfloat),  /* byte offset between consecutive attributes */
-            0,                  /* byte offset of first element in the buffer */
-            false);             /* normalized flag */
-        gl::attribute_divisor(m_gl.program, "a_point_pos", 1);
-
-        gl::enable_attribute(m_gl.program, "a_point_col");
-        gl::attribute_pointer(
-            m_gl.program,
-            "a_point_col",
-            GL_FLOAT_VEC3,
-            7*sizeof(GLfloat),  /* byte offset between consecutive attributes */
-            3*sizeof(GLfloat),  /* byte offset of first element in the buffer */
-            false);             /* normalized flag */
-        gl::attribute_divisor(m_gl.program, "a_point_col", 1);
-
-        gl::enable_attribute(m_gl.program, "a_point_radius");
-        gl::attribute_pointer(
-            m_gl.program,
-            "a_point_radius",
-            GL_FLOAT,
-            7*sizeof(GLfloat),  /* byte offset between consecutive attributes */
-            6*sizeof(GLfloat),  /* byte offset of first element in the buffer */
-            false);             /* normalized flag */
-        gl::attribute_divisor(m_gl.program, "a_point_radius", 1);
-
-        /* Unbind vertex array object. */
-        glBindVertexArray(0);
+        for (size_t set = 0; set < m_gl.n_sets; ++set) {
+            m_gl.vao[set] = gl::create_vertex_array();
+            glBindVertexArray(m_gl.vao[set]);
+
+            /* Normalized integer attributes are specified directly. */
+            glBindBuffer(GL_ARRAY_BUFFER, m_gl.point_vbo[set]);
+            GLint loc_pos = glGetAttribLocation(m_gl.program, "a_point_pos");
+            glEnableVertexAttribArray(loc_pos);
+            glVertexAttribPointer(
+                loc_pos,
+                4,                  /* number of components */
+                GL_UNSIGNED_SHORT,  /* unorm16 */
+                GL_TRUE,            /* normalized flag */
+                sizeof(PointVertex),/* byte offset between consecutive attributes */
+                (GLvoid *) offsetof(PointVertex, pos));
+            glVertexAttribDivisor(loc_pos, 1);
+
+            GLint loc_col = glGetAttribLocation(m_gl.program, "a_point_col");
+            glEnableVertexAttribArray(loc_col);
+            glVertexAttribPointer(
+                loc_col,
+                4,                  /* number of components */
+                GL_UNSIGNED_BYTE,   /* RGBA8 */
+                GL_TRUE,            /* normalized flag */
+                sizeof(PointVertex),/* byte offset between consecutive attributes */
+                (GLvoid *) offsetof(PointVertex, col));
+            glVertexAttribDivisor(loc_col, 1);
+
+            /* Unbind vertex array object. */
+            glBindVertexArray(0);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+
+        /*
+         * Create buffer storage for the surface vertex data with layout:
+         * {(xyz, nx ny nz)_1, (xyz, nx ny nz)_2, ...}
+         * and its indirect draw arguments, both written by OpenCL.
+         */
+        if (m_surface) {
+            /* Create the surface shader program object. */
+            std::vector<GLuint> shaders{
+                gl::create_shader(GL_VERTEX_SHADER, "data/hashmap-surface.vert"),
+                gl::create_shader(GL_FRAGMENT_SHADER, "data/hashmap-surface.frag")};
+            m_gl.surface_program = gl::create_program(shaders);
+            std::cout << gl::get_program_info(m_gl.surface_program) << "\n";
+
+            const DrawArgs args = {0, 1, 0, 0};
+            for (size_t set = 0; set < m_gl.n_sets; ++set) {
+                m_gl.surface_vbo[set] = gl::create_buffer(
+                    GL_ARRAY_BUFFER,
+                    6 * Params::max_vertices * sizeof(GLfloat),
+                    GL_DYNAMIC_DRAW);
+
+                m_gl.surface_args[set] = gl::create_buffer(
+                    GL_DRAW_INDIRECT_BUFFER,
+                    sizeof(DrawArgs),
+                    GL_DYNAMIC_DRAW);
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_gl.surface_args[set]);
+                glBufferSubData(
+                    GL_DRAW_INDIRECT_BUFFER,            /* target binding point */
+                    0,                                  /* offset in data store */
+                    sizeof(DrawArgs),                   /* data store size in bytes */
+                    &args);                             /* pointer to data source */
+                glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+
+                /* Set surface vertex data format. */
+                m_gl.surface_vao[set] = gl::create_vertex_array();
+                glBindVertexArray(m_gl.surface_vao[set]);
+                glBindBuffer(GL_ARRAY_BUFFER, m_gl.surface_vbo[set]);
+                gl::enable_attribute(m_gl.surface_program, "a_vertex_pos");
+                gl::attribute_pointer(
+                    m_gl.surface_program,
+                    "a_vertex_pos",
+                    GL_FLOAT_VEC3,
+                    6*sizeof(GLfloat),  /* byte offset between consecutive attributes */
+                    0,                  /* byte offset of first element in the buffer */
+                    false);             /* normalized flag */
+                gl::enable_attribute(m_gl.surface_program, "a_vertex_normal");
+                gl::attribute_pointer(
+                    m_gl.surface_program,
+                    "a_vertex_normal",
+                    GL_FLOAT_VEC3,
+                    6*sizeof(GLfloat),  /* byte offset between consecutive attributes */
+                    3*sizeof(GLfloat),  /* byte offset of first element in the buffer */
+                    false);             /* normalized flag */
+                glBindVertexArray(0);
+                glBindBuffer(GL_ARRAY_BUFFER, 0);
+            }
+        }
     }
 
     /*
      * Setup OpenCL data.
      */
-    {
-        /*
-         * Setup OpenCL context with a command queue on the specified device.
-         */
-        // m_context = cl::Context::create(CL_DEVICE_TYPE_GPU);
-        // m_device = cl::Context::get_device(m_context, Params::device_index);
-        // m_queue = cl::Queue::create(m_context, m_device);
-
+    if (!Params::cpu_backend) {
         /*
-         * Setup OpenCL context based on the OpenGL context in the device.
+         * Setup OpenCL context on the selected device, based on the OpenGL
+         * context if the device shares the point buffers.
          */
-        std::vector<cl_device_id> devices = cl::Device::get_device_ids(CL_DEVICE_TYPE_GPU);
-        core_assert(Params::device_index < devices.size(), "device index overflow");
-        m_device = devices[Params::device_index];
-        m_context = cl::Context::create_cl_gl_shared(m_device);
-        m_queue = cl::Queue::create(m_context, m_device);
+        if (m_interop) {
+            m_context = cl::Context::create_cl_gl_shared(m_device);
+        } else {
+            cl_int err;
+            m_context = clCreateContext(NULL, 1, &m_device, NULL, NULL, &err);
+            core_assert(err == CL_SUCCESS, "clCreateContext");
+        }
+        m_queue = cl::Queue::create(
+            m_context,
+            m_device,
+            m_profiler.enabled() ? CL_QUEUE_PROFILING_ENABLE : 0);
         std::cout << cl::Device::get_info_string(m_device) << "\n";
 
         /*
-         * Create the program object.
+         * Create the program object, from the program cache if it was built
+         * before with the same source and options on the same device.
          */
-        m_program = cl::Program::create_from_file(m_context, "data/hashmap-points.cl");
-        cl::Program::build(m_program, m_device, "");
-        std::cout << cl::Program::get_source(m_program) << "\n";
+        std::string options = Params::build_options();
+        if (Params::diagnostics) {
+            std::cout << options << "\n";
+        }
+        m_program = build_program(
+            m_context,
+            m_device,
+            "data/hashmap-points.cl",
+            options,
+            Params::program_cache);
 
         /*
          * Create the program kernels.
          */
         m_kernels.resize(NumKernels, NULL);
-        m_kernels[KernelHashmapClear] = cl::Kernel::create(m_program, "hashmap_clear");
+        m_kernels[KernelSortGlobal] = cl::Kernel::create(m_program, "bitonic_sort_global");
+        m_kernels[KernelSortLocal] = cl::Kernel::create(m_program, "bitonic_sort_local");
         m_kernels[KernelHashmapBuild] = cl::Kernel::create(m_program, "hashmap_build");
-        m_kernels[KernelHashmapQuery] = cl::Kernel::create(m_program, "hashmap_query");
+        m_kernels[KernelRandomPoints] = cl::Kernel::create(m_program, "random_points");
+        m_kernels[KernelPointIds] = cl::Kernel::create(m_program, "point_ids");
+        m_kernels[KernelReorderPoints] = cl::Kernel::create(m_program, "reorder_points");
+        m_kernels[KernelQueryCount] = cl::Kernel::create(m_program, "query_count");
+        m_kernels[KernelQueryFill] = cl::Kernel::create(m_program, "query_fill");
+        m_kernels[KernelQueryMark] = cl::Kernel::create(m_program, "query_mark");
+        m_kernels[KernelQueryWeights] = cl::Kernel::create(m_program, "query_weights");
+        m_kernels[KernelScanBlocks] = cl::Kernel::create(m_program, "scan_blocks");
+        m_kernels[KernelScanAdd] = cl::Kernel::create(m_program, "scan_add");
+        m_kernels[KernelCompactIndices] = cl::Kernel::create(m_program, "compact_indices");
+        m_kernels[KernelSegmentSum] = cl::Kernel::create(m_program, "segment_sum");
+        m_kernels[KernelComputeForces] = cl::Kernel::create(m_program, "compute_forces");
         m_kernels[KerkelUpdatePoints] = cl::Kernel::create(m_program, "update_points");
-        m_kernels[KerkelUpdateVertex] = cl::Kernel::create(m_program, "update_vertex");
+        if (m_surface) {
+            m_kernels[KernelSurfaceDensity] = cl::Kernel::create(m_program, "surface_density");
+            m_kernels[KernelSurfaceClassify] = cl::Kernel::create(m_program, "surface_classify");
+            m_kernels[KernelSurfaceGenerate] = cl::Kernel::create(m_program, "surface_generate");
+            m_kernels[KernelSurfaceDrawArgs] = cl::Kernel::create(m_program, "surface_draw_args");
+        }
+        if (!m_headless) {
+            m_kernels[KernelPackPoints] = cl::Kernel::create(m_program, "pack_points");
+        }
+        if (m_cull) {
+            m_kernels[KernelCullPoints] = cl::Kernel::create(m_program, "cull_points");
+            m_kernels[KernelCullCompact] = cl::Kernel::create(m_program, "cull_compact");
+            m_kernels[KernelCullDrawArgs] = cl::Kernel::create(m_program, "cull_draw_args");
+        }
+        if (m_neighbors) {
+            m_kernels[KernelNeighborCheck] = cl::Kernel::create(m_program, "neighbor_check");
+            m_kernels[KernelNeighborCount] = cl::Kernel::create(m_program, "neighbor_count");
+            m_kernels[KernelNeighborFill] = cl::Kernel::create(m_program, "neighbor_fill");
+            m_kernels[KernelNeighborForces] = cl::Kernel::create(m_program, "neighbor_forces");
+        }
 
         /*
          * Create memory buffers.
@@ -210,28 +393,320 @@ Model::Model()
         m_buffers[BufferHashmap] = cl::Memory::create_buffer(
             m_context,
             CL_MEM_READ_WRITE,
-            Params::capacity * sizeof(KeyValue),
+            Params::capacity * sizeof(Cell),
+            (void *) NULL);
+        m_buffers[BufferKeys] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::n_sort * sizeof(KeyValue),
+            (void *) NULL);
+        m_buffers[BufferStats] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            sizeof(Stats),
+            (void *) NULL);
+        m_buffers[BufferPointPos] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            3 * Params::n_points * sizeof(cl_float),
+            (void *) NULL);
+        m_buffers[BufferPointCol] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::n_points * sizeof(cl_uchar4),
+            (void *) NULL);
+        m_buffers[BufferPointRadius] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::n_points * sizeof(cl_uchar),
+            (void *) NULL);
+        m_buffers[BufferPointPosSwap] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            3 * Params::n_points * sizeof(cl_float),
+            (void *) NULL);
+        m_buffers[BufferPointColSwap] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::n_points * sizeof(cl_uchar4),
+            (void *) NULL);
+        m_buffers[BufferPointRadiusSwap] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::n_points * sizeof(cl_uchar),
+            (void *) NULL);
+        m_buffers[BufferPointVel] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            3 * Params::n_points * sizeof(cl_float),
+            (void *) NULL);
+        m_buffers[BufferPointVelSwap] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            3 * Params::n_points * sizeof(cl_float),
             (void *) NULL);
-        m_buffers[BufferPoints] = cl::Memory::create_buffer(
+        m_buffers[BufferPointIds] = cl::Memory::create_buffer(
             m_context,
             CL_MEM_READ_WRITE,
-            Params::n_points * sizeof(Point),
+            Params::n_points * sizeof(cl_uint),
             (void *) NULL);
-        m_buffers[BufferVertex] = cl::gl::create_from_gl_buffer(
+        m_buffers[BufferPointIdsSwap] = cl::Memory::create_buffer(
             m_context,
             CL_MEM_READ_WRITE,
-            m_gl.point_vbo);
+            Params::n_points * sizeof(cl_uint),
+            (void *) NULL);
+        m_buffers[BufferProbes] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_ONLY,
+            Params::max_probes * sizeof(Probe),
+            (void *) NULL);
+        m_buffers[BufferQueryCounts] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::max_probes * sizeof(cl_uint),
+            (void *) NULL);
+        m_buffers[BufferQueryOffsets] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            (Params::max_probes + 1) * sizeof(cl_uint),
+            (void *) NULL);
+        m_buffers[BufferQueryIndices] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::max_hits * sizeof(cl_uint),
+            (void *) NULL);
+        m_buffers[BufferQueryWeights] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::max_hits * sizeof(cl_float),
+            (void *) NULL);
+        m_buffers[BufferQueryDensity] = cl::Memory::create_buffer(
+            m_context,
+            CL_MEM_READ_WRITE,
+            Params::max_probes * sizeof(cl_float),
+            (void *) NULL);
+
+        /*
+         * Create the block totals of each scan level, down to a single
+         * block, for the largest scan of the model.
+         */
+        {
+            const cl_uint block = 2 * Params::work_group_size;
+            cl_uint n = std::max({Params::max_probes, Params::n_points, Params::n_voxels});
+            while (true) {
+                const cl_uint n_blocks = (n + block - 1) / block;
+                m_scan_sums.push_back(cl::Memory::create_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE,
+                    (n_blocks + 1) * sizeof(cl_uint),
+                    (void *) NULL));
+                if (n_blocks <= 1) {
+                    break;
+                }
+                n = n_blocks;
+            }
+        }
+
+        /*
+         * Create the surface buffers. The vertex and draw argument buffers
+         * are the shared buffers of each set, and plain buffers headless.
+         */
+        if (m_surface) {
+            m_buffers[BufferSurfaceDensity] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_voxels * sizeof(cl_float),
+                (void *) NULL);
+            m_buffers[BufferSurfaceCounts] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_voxels * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferSurfaceOccupied] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_voxels * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferSurfaceVertexOffsets] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                (Params::n_voxels + 1) * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferSurfaceOccupiedOffsets] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                (Params::n_voxels + 1) * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferSurfaceActive] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_voxels * sizeof(cl_uint),
+                (void *) NULL);
+            if (!m_interop) {
+                m_buffers[BufferSurfaceVertices] = cl::Memory::create_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE,
+                    6 * Params::max_vertices * sizeof(cl_float),
+                    (void *) NULL);
+                m_buffers[BufferSurfaceDrawArgs] = cl::Memory::create_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE,
+                    sizeof(DrawArgs),
+                    (void *) NULL);
+            }
+        }
+
+        /*
+         * Create the packed point vertices buffer, read back for drawing
+         * without OpenGL sharing.
+         */
+        if (!m_headless && !m_interop) {
+            m_buffers[BufferPointVertices] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_points * sizeof(PointVertex),
+                (void *) NULL);
+        }
+
+        /*
+         * Create the frustum culling buffers, the visibility flags of the
+         * points and their exclusive scan.
+         */
+        if (m_cull) {
+            m_buffers[BufferCullFlags] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_points * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferCullOffsets] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                (Params::n_points + 1) * sizeof(cl_uint),
+                (void *) NULL);
+        }
+
+        /*
+         * Create the neighbor list buffers, the rebuild flag, the point
+         * positions of the last build and the lists in CSR format.
+         */
+        if (m_neighbors) {
+            m_buffers[BufferNeighborRebuild] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferNeighborPos] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                3 * Params::n_points * sizeof(cl_float),
+                (void *) NULL);
+            m_buffers[BufferNeighborCounts] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::n_points * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferNeighborOffsets] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                (Params::n_points + 1) * sizeof(cl_uint),
+                (void *) NULL);
+            m_buffers[BufferNeighborIndices] = cl::Memory::create_buffer(
+                m_context,
+                CL_MEM_READ_WRITE,
+                Params::max_neighbors * sizeof(cl_uint),
+                (void *) NULL);
+        }
+
+        /*
+         * Share the vertex buffers of each set with OpenGL sharing, in the
+         * order of the Shared enum so each set is acquired in one call.
+         */
+        if (m_interop) {
+            m_shared.resize(NumShared * m_gl.n_sets, NULL);
+            for (size_t set = 0; set < m_gl.n_sets; ++set) {
+                cl_mem *shared = &m_shared[NumShared * set];
+                shared[SharedPointVertices] = cl::gl::create_from_gl_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE,
+                    m_gl.point_vbo[set]);
+                shared[SharedPointDrawArgs] = cl::gl::create_from_gl_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE,
+                    m_gl.point_args[set]);
+                if (m_surface) {
+                    shared[SharedSurfaceVertices] = cl::gl::create_from_gl_buffer(
+                        m_context,
+                        CL_MEM_READ_WRITE,
+                        m_gl.surface_vbo[set]);
+                    shared[SharedSurfaceDrawArgs] = cl::gl::create_from_gl_buffer(
+                        m_context,
+                        CL_MEM_READ_WRITE,
+                        m_gl.surface_args[set]);
+                }
+            }
+        }
 
         /*
          * Copy point data to the device.
-        */
-        cl::Queue::enqueue_write_buffer(
-            m_queue,
-            m_buffers[BufferPoints],
-            CL_TRUE,
-            0,
-            Params::n_points * sizeof(Point),
-            (void *) &m_points[0]);
+         */
+        load_points();
+
+        /* Bind the kernel arguments that never change. */
+        bind_args();
+
+        /*
+         * Create the trajectory snapshots, pinned host buffers mapped once
+         * for the lifetime of the model, and the writer of their frames.
+         */
+        if (!Params::trajectory_file.empty()) {
+            std::vector<TrajectoryWriter::Slot> slots;
+            for (size_t i = 0; i < Params::n_snapshots; ++i) {
+                Snapshot snapshot = {};
+                snapshot.pos = cl::Memory::create_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                    3 * Params::n_points * sizeof(cl_float),
+                    (void *) NULL);
+                snapshot.ids = cl::Memory::create_buffer(
+                    m_context,
+                    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+                    Params::n_points * sizeof(cl_uint),
+                    (void *) NULL);
+
+                cl_int err;
+                snapshot.pos_ptr = (cl_float *) clEnqueueMapBuffer(
+                    m_queue,
+                    snapshot.pos,
+                    CL_TRUE,
+                    CL_MAP_READ | CL_MAP_WRITE,
+                    0,
+                    3 * Params::n_points * sizeof(cl_float),
+                    0,
+                    NULL,
+                    NULL,
+                    &err);
+                core_assert(err == CL_SUCCESS, "clEnqueueMapBuffer");
+                snapshot.ids_ptr = (cl_uint *) clEnqueueMapBuffer(
+                    m_queue,
+                    snapshot.ids,
+                    CL_TRUE,
+                    CL_MAP_READ | CL_MAP_WRITE,
+                    0,
+                    Params::n_points * sizeof(cl_uint),
+                    0,
+                    NULL,
+                    NULL,
+                    &err);
+                core_assert(err == CL_SUCCESS, "clEnqueueMapBuffer");
+
+                m_snapshots.push_back(snapshot);
+                slots.push_back({snapshot.pos_ptr, snapshot.ids_ptr});
+            }
+            m_writer.reset(new TrajectoryWriter(
+                Params::trajectory_file,
+                slots,
+                Params::trajectory_quantize));
+        }
     }
 }
 
@@ -242,21 +717,68 @@ Model::Model()
 Model::~Model()
 {
     /* Teardown OpenCL data. */
-    {
+    if (!Params::cpu_backend) {
+        m_profiler.collect(true);
+
+        /* Write the pending snapshots before unmapping them. */
+        m_writer.reset();
+        for (auto &it : m_snapshots) {
+            clEnqueueUnmapMemObject(m_queue, it.pos, it.pos_ptr, 0, NULL, NULL);
+            clEnqueueUnmapMemObject(m_queue, it.ids, it.ids_ptr, 0, NULL, NULL);
+        }
+        cl::Queue::finish(m_queue);
+        for (auto &it : m_snapshots) {
+            cl::Memory::release(it.pos);
+            cl::Memory::release(it.ids);
+        }
+
+        for (auto &it : m_set_events) {
+            if (it != NULL) {
+                clWaitForEvents(1, &it);
+                clReleaseEvent(it);
+            }
+        }
+        for (auto &it : m_readbacks) {
+            if (it.event != NULL) {
+                clWaitForEvents(1, &it.event);
+                clReleaseEvent(it.event);
+            }
+        }
         for (auto &it : m_images) {
             cl::Memory::release(it);
         }
         for (auto &it : m_buffers) {
+            if (it != NULL) {
+                cl::Memory::release(it);
+            }
+        }
+        for (auto &it : m_scan_sums) {
             cl::Memory::release(it);
         }
+        for (auto &it : m_shared) {
+            if (it != NULL) {
+                cl::Memory::release(it);
+            }
+        }
         for (auto &it : m_kernels) {
-            cl::Kernel::release(it);
+            if (it != NULL) {
+                cl::Kernel::release(it);
+            }
         }
         cl::Program::release(m_program);
         cl::Queue::release(m_queue);
         cl::Device::release(m_device);
         cl::Context::release(m_context);
     }
+
+    /* Delete the draw fences. */
+    if (!m_headless) {
+        for (auto &it : m_gl.fences) {
+            if (it != NULL) {
+                glDeleteSync(it);
+            }
+        }
+    }
 }
 
 /** ---------------------------------------------------------------------------
@@ -328,9 +850,24 @@ void Model::draw(void *data)
     glEnable(GL_BLEND);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
+    /*
+     * Draw the vertex buffer set written by the previous frame while OpenCL
+     * writes the current frame into the next one. A single set is drawn as
+     * soon as it is written, which serializes the frames. Wait for OpenCL
+     * to finish the set, which it usually has by now.
+     */
+    const size_t lag = m_gl.n_sets > 1 ? 2 : 1;
+    const size_t set = (m_frame + m_gl.n_sets - lag) % m_gl.n_sets;
+    if (m_frame < lag) {
+        return;                 /* no set is written yet */
+    }
+    if (!Params::cpu_backend) {
+        wait_set(set);
+    }
+
     /* Bind the shader program object and vertex array object. */
     glUseProgram(m_gl.program);
-    glBindVertexArray(m_gl.vao);
+    glBindVertexArray(m_gl.vao[set]);
 
     /* Set uniforms and draw. */
 #if 0
@@ -345,136 +882,458 @@ void Model::draw(void *data)
     gl::set_uniform_matrix(m_gl.program, "u_persp", GL_FLOAT_MAT4, true,
         m_gl.camera.persp().data());
 
-    glDrawElementsInstanced(
-        GL_TRIANGLES,               /* what kind of primitives? */
-        m_gl.sprite_index.size(),   /* number of elements to render */
-        GL_UNSIGNED_INT,            /* type of the values in indices */
-        (GLvoid *) 0,               /* pointer to indices storage location */
-        Params::n_points);          /* number of instances to be rendered */
+    /* The sprites face the camera along its view basis. */
+    const GLfloat domain_size[3] = {
+        Params::domain_hi.s[0] - Params::domain_lo.s[0],
+        Params::domain_hi.s[1] - Params::domain_lo.s[1],
+        Params::domain_hi.s[2] - Params::domain_lo.s[2]};
+    gl::set_uniform(m_gl.program, "u_right", GL_FLOAT_VEC3, m_gl.camera.right().data());
+    gl::set_uniform(m_gl.program, "u_up", GL_FLOAT_VEC3, m_gl.camera.view_up().data());
+    gl::set_uniform(m_gl.program, "u_domain_lo", GL_FLOAT_VEC3, &Params::domain_lo.s[0]);
+    gl::set_uniform(m_gl.program, "u_domain_size", GL_FLOAT_VEC3, &domain_size[0]);
+
+    if (m_gl.draw_indirect) {
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_gl.point_args[set]);
+        glDrawArraysIndirect(
+            GL_TRIANGLE_STRIP,          /* what kind of primitives? */
+            (GLvoid *) 0);              /* offset of the draw arguments */
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    } else {
+        glDrawArraysInstanced(
+            GL_TRIANGLE_STRIP,          /* what kind of primitives? */
+            0,                          /* index of the first vertex */
+            4,                          /* triangle strip per sprite */
+            Params::n_points);          /* every point, not culled */
+    }
 
     /* Unbind the vertex array object and shader program object. */
     glBindVertexArray(0);
     glUseProgram(0);
-}
-
-/** ---------------------------------------------------------------------------
- * Model::execute
- * @brief Execute the model.
- */
-void Model::execute(void)
-{
-    /* Update probe */
-    {
-        const math::vec3f domain_lo{
-            Params::domain_lo.s[0],
-            Params::domain_lo.s[1],
-            Params::domain_lo.s[2]};
 
-        const math::vec3f domain_hi{
-            Params::domain_hi.s[0],
-            Params::domain_hi.s[1],
-            Params::domain_hi.s[2]};
+    /*
+     * Draw the translucent surface over the points, with the vertex count in
+     * the draw arguments written by OpenCL.
+     */
+    if (m_surface) {
+        glDepthMask(GL_FALSE);
+        glUseProgram(m_gl.surface_program);
+        glBindVertexArray(m_gl.surface_vao[set]);
 
-        const cl_float dt = 0.02f;
-        const cl_float theta = dt * glfwGetTime();
-        const cl_float radius = std::cos(theta) * math::norm(domain_hi - domain_lo);
+        gl::set_uniform_matrix(m_gl.surface_program, "u_view", GL_FLOAT_MAT4, true,
+            m_gl.camera.view().data());
+        gl::set_uniform_matrix(m_gl.surface_program, "u_persp", GL_FLOAT_MAT4, true,
+            m_gl.camera.persp().data());
 
-        cl_float x = m_probe.pos.s[0];
-        cl_float y = m_probe.pos.s[1];
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, m_gl.surface_args[set]);
+        glDrawArraysIndirect(GL_TRIANGLES, (GLvoid *) 0);
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
 
-        /* Update probe position and apply periodic boundary conditions. */
-        m_probe.pos.s[0] -= dt * radius * std::sin(theta);
-        m_probe.pos.s[1] += dt * radius * std::sin(theta);
-        m_probe.pos.s[2] += dt * radius * std::cos(theta);
+        glBindVertexArray(0);
+        glUseProgram(0);
+        glDepthMask(GL_TRUE);
+    }
 
-        for (size_t i = 0; i < 3; ++i) {
-            cl_float len = Params::domain_hi.s[i] - Params::domain_lo.s[i];
-            if (m_probe.pos.s[i] < Params::domain_lo.s[i]) {
-                m_probe.pos.s[i] += len;
-            } else if (m_probe.pos.s[i] > Params::domain_hi.s[i]) {
-                m_probe.pos.s[i] -= len;
-            }
+    /*
+     * Fence the draw commands reading the set, so OpenCL acquires the set
+     * only after OpenGL is done with it. The previous fence is deleted here
+     * rather than after the acquire, since an OpenCL event created from it
+     * may still be pending.
+     */
+    if (m_interop) {
+        if (m_gl.fences[set] != NULL) {
+            glDeleteSync(m_gl.fences[set]);
         }
+        m_gl.fences[set] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        glFlush();
     }
+}
 
+/** ---------------------------------------------------------------------------
+ * Model::load_points
+ * @brief Write the point data to the device without blocking. Random point
+ * positions are generated in place by the random_points kernel. The point
+ * positions of a packed point file are written in chunks straight from the
+ * mapping, which stays mapped for the lifetime of the model. Other point
+ * files are gathered into two staging chunks, each reused once its write
+ * completes. The uniform point data is filled.
+ */
+void Model::load_points(void)
+{
     /*
-     * Clear the hashmap
+     * Write the point positions.
      */
-    {
-        /* Set kernel arguments. */
-        cl::Kernel::set_arg(m_kernels[KernelHashmapClear], 0, sizeof(cl_mem),  (void *) &m_buffers[BufferHashmap]);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapClear], 1, sizeof(cl_uint), (void *) &Params::capacity);
-
-        /* Run the kernel */
+    if (!m_file) {
         static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
         static cl::NDRange local_ws(Params::work_group_size);
 
+        cl::Kernel::set_arg(m_kernels[KernelRandomPoints], 0, sizeof(cl_mem),  (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelRandomPoints], 1, sizeof(cl_uint), (void *) &Params::seed);
         cl::Queue::enqueue_nd_range_kernel(
             m_queue,
-            m_kernels[KernelHashmapClear],
+            m_kernels[KernelRandomPoints],
             cl::NDRange::Null,
             global_ws,
             local_ws);
+    } else if (m_file->is_packed()) {
+        for (size_t first = 0; first < Params::n_points; first += Params::load_chunk) {
+            size_t count = std::min(Params::load_chunk, Params::n_points - first);
+            cl::Queue::enqueue_write_buffer(
+                m_queue,
+                m_buffers[BufferPointPos],
+                CL_FALSE,
+                3 * first * sizeof(cl_float),
+                3 * count * sizeof(cl_float),
+                (void *) m_file->packed(first));
+        }
+        clFlush(m_queue);
+    } else {
+        std::vector<cl_float> staging[2];
+        cl_event events[2] = {NULL, NULL};
+        for (size_t first = 0, i = 0; first < Params::n_points; first += Params::load_chunk, i ^= 1) {
+            if (events[i] != NULL) {
+                clWaitForEvents(1, &events[i]);
+                clReleaseEvent(events[i]);
+            }
+
+            size_t count = std::min(Params::load_chunk, Params::n_points - first);
+            staging[i].resize(3 * count);
+            m_file->gather(&staging[i][0], first, count);
+            cl::Queue::enqueue_write_buffer(
+                m_queue,
+                m_buffers[BufferPointPos],
+                CL_FALSE,
+                3 * first * sizeof(cl_float),
+                3 * count * sizeof(cl_float),
+                (void *) &staging[i][0],
+                0,
+                NULL,
+                &events[i]);
+            clFlush(m_queue);
+        }
+
+        /* The staging chunks are released on return. */
+        clWaitForEvents(events[1] != NULL ? 2 : 1, &events[0]);
+        for (auto &it : events) {
+            if (it != NULL) {
+                clReleaseEvent(it);
+            }
+        }
     }
 
-    /*
-     * Build the hashmap
-     */
+    /* Set the original point ids, tracked through the reorders. */
     {
-        /* Set kernel arguments. */
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 0, sizeof(cl_mem),    (void *) &m_buffers[BufferHashmap]);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 1, sizeof(cl_uint),   (void *) &Params::capacity);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 2, sizeof(cl_mem),    (void *) &m_buffers[BufferPoints]);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 3, sizeof(cl_uint),   (void *) &Params::n_points);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 4, sizeof(cl_uint),   (void *) &Params::n_cells);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 5, sizeof(cl_float3), (void *) &Params::domain_lo);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 6, sizeof(cl_float3), (void *) &Params::domain_hi);
-
-        /* Run the kernel */
         static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
         static cl::NDRange local_ws(Params::work_group_size);
 
+        cl::Kernel::set_arg(m_kernels[KernelPointIds], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointIds]);
         cl::Queue::enqueue_nd_range_kernel(
             m_queue,
-            m_kernels[KernelHashmapBuild],
+            m_kernels[KernelPointIds],
             cl::NDRange::Null,
             global_ws,
             local_ws);
     }
 
     /*
-     * Query the hashmap
+     * Fill the point colors, white, the radii, 0.1 in unorm8, and the
+     * velocities, at rest.
      */
-    {
-        /* Set kernel arguments. */
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 0, sizeof(cl_mem),    (void *) &m_buffers[BufferPoints]);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 1, sizeof(cl_uint),   (void *) &Params::n_points);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 2, sizeof(cl_uint),   (void *) &Params::n_cells);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 3, sizeof(cl_float3), (void *) &Params::domain_lo);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 4, sizeof(cl_float3), (void *) &Params::domain_hi);
-        cl::Kernel::set_arg(m_kernels[KernelHashmapQuery], 5, sizeof(Point),     (void *) &m_probe);
-
-        /* Run the kernel */
-        static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
-        static cl::NDRange local_ws(Params::work_group_size);
-
-        cl::Queue::enqueue_nd_range_kernel(
+    const cl_uchar4 col = {{255, 255, 255, 255}};
+    const cl_uchar radius = 26;
+    const cl_float vel = 0.0f;
+    const struct {
+        cl_mem buffer;
+        const void *pattern;
+        size_t pattern_size;
+        size_t size;
+    } fills[3] = {
+        {m_buffers[BufferPointCol],    &col,    sizeof(col),    Params::n_points * sizeof(cl_uchar4)},
+        {m_buffers[BufferPointRadius], &radius, sizeof(radius), Params::n_points * sizeof(cl_uchar)},
+        {m_buffers[BufferPointVel],    &vel,    sizeof(vel),    3 * Params::n_points * sizeof(cl_float)}};
+    for (auto &it : fills) {
+        cl_int err = clEnqueueFillBuffer(
             m_queue,
-            m_kernels[KernelHashmapQuery],
-            cl::NDRange::Null,
-            global_ws,
-            local_ws);
+            it.buffer,
+            it.pattern,
+            it.pattern_size,
+            0,
+            it.size,
+            0,
+            NULL,
+            NULL);
+        core_assert(err == CL_SUCCESS, "clEnqueueFillBuffer");
     }
+}
 
-    /*
-     * Update points
-     */
-    {
-        /* Set kernel arguments. */
-        cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 0, sizeof(cl_mem),    (void *) &m_buffers[BufferPoints]);
-        cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 1, sizeof(cl_uint),   (void *) &Params::n_points);
-        cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 2, sizeof(cl_float3), (void *) &Params::domain_lo);
-        cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 3, sizeof(cl_float3), (void *) &Params::domain_hi);
+/** ---------------------------------------------------------------------------
+ * Model::bind_args
+ * @brief Bind the kernel arguments that are fixed across frames, the buffers
+ * and the diagnostics flag. Kernel arguments persist across launches, so
+ * each frame only sets the arguments that change: the sort steps, the
+ * probes, the scan ranges, the camera and the vertex buffers of the frame.
+ * Model::reorder binds them again after it swaps the point buffers.
+ */
+void Model::bind_args(void)
+{
+    /* Update points */
+    cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 1, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+    cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 2, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+    cl::Kernel::set_arg(m_kernels[KerkelUpdatePoints], 3, sizeof(cl_mem), (void *) &m_buffers[BufferPointVel]);
+
+    /* Sort */
+    cl::Kernel::set_arg(m_kernels[KernelSortGlobal], 0, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+    cl::Kernel::set_arg(m_kernels[KernelSortLocal],  0, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+
+    /* Build the hashmap */
+    const cl_uint collect = Params::diagnostics ? 1 : 0;
+    cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 0, sizeof(cl_mem),  (void *) &m_buffers[BufferHashmap]);
+    cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 1, sizeof(cl_mem),  (void *) &m_buffers[BufferKeys]);
+    cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 2, sizeof(cl_mem),  (void *) &m_buffers[BufferStats]);
+    cl::Kernel::set_arg(m_kernels[KernelHashmapBuild], 3, sizeof(cl_uint), (void *) &collect);
+
+
+
+    /* Reorder */
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointPosSwap]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointColSwap]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 2, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadiusSwap]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 3, sizeof(cl_mem), (void *) &m_buffers[BufferPointVelSwap]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 4, sizeof(cl_mem), (void *) &m_buffers[BufferPointIdsSwap]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 5, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 6, sizeof(cl_mem), (void *) &m_buffers[BufferPointCol]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 7, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadius]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 8, sizeof(cl_mem), (void *) &m_buffers[BufferPointVel]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 9, sizeof(cl_mem), (void *) &m_buffers[BufferPointIds]);
+    cl::Kernel::set_arg(m_kernels[KernelReorderPoints], 10, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+
+    /* Query */
+    cl::Kernel::set_arg(m_kernels[KernelQueryCount], 0, sizeof(cl_mem), (void *) &m_buffers[BufferQueryCounts]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryCount], 3, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryCount], 4, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryCount], 5, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 0, sizeof(cl_mem), (void *) &m_buffers[BufferQueryIndices]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 1, sizeof(cl_mem), (void *) &m_buffers[BufferQueryOffsets]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 4, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 5, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 6, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 7, sizeof(cl_mem), (void *) &m_buffers[BufferPointCol]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryFill], 8, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadius]);
+
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointCol]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadius]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 2, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 3, sizeof(cl_mem), (void *) &m_buffers[BufferQueryOffsets]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 4, sizeof(cl_mem), (void *) &m_buffers[BufferQueryIndices]);
+
+    cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 0, sizeof(cl_mem), (void *) &m_buffers[BufferQueryWeights]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 2, sizeof(cl_mem), (void *) &m_buffers[BufferQueryOffsets]);
+    cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 3, sizeof(cl_mem), (void *) &m_buffers[BufferQueryIndices]);
+
+    /* Compute forces */
+    cl::Kernel::set_arg(m_kernels[KernelComputeForces], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointVel]);
+    cl::Kernel::set_arg(m_kernels[KernelComputeForces], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+    cl::Kernel::set_arg(m_kernels[KernelComputeForces], 2, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+    cl::Kernel::set_arg(m_kernels[KernelComputeForces], 3, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+
+    /* Surface */
+    if (m_surface) {
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceDensity], 0, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceDensity]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceDensity], 1, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceDensity], 2, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceDensity], 3, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceClassify], 0, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceCounts]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceClassify], 1, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceOccupied]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceClassify], 2, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceDensity]);
+
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceGenerate], 1, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceActive]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceGenerate], 2, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceOccupiedOffsets]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceGenerate], 3, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceVertexOffsets]);
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceGenerate], 4, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceDensity]);
+
+        cl::Kernel::set_arg(m_kernels[KernelSurfaceDrawArgs], 1, sizeof(cl_mem), (void *) &m_buffers[BufferSurfaceVertexOffsets]);
+    }
+
+    /* Pack points */
+    if (!m_headless) {
+        cl::Kernel::set_arg(m_kernels[KernelPackPoints], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelPackPoints], 2, sizeof(cl_mem), (void *) &m_buffers[BufferPointCol]);
+        cl::Kernel::set_arg(m_kernels[KernelPackPoints], 3, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadius]);
+    }
+
+    /* Frustum culling */
+    if (m_cull) {
+        const cl_float margin = Params::cull_margin;
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 0, sizeof(cl_mem),   (void *) &m_buffers[BufferCullFlags]);
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 1, sizeof(cl_mem),   (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 2, sizeof(cl_mem),   (void *) &m_buffers[BufferPointRadius]);
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 3, sizeof(cl_float), (void *) &margin);
+
+        cl::Kernel::set_arg(m_kernels[KernelCullCompact], 1, sizeof(cl_mem), (void *) &m_buffers[BufferCullOffsets]);
+        cl::Kernel::set_arg(m_kernels[KernelCullCompact], 2, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelCullCompact], 3, sizeof(cl_mem), (void *) &m_buffers[BufferPointCol]);
+        cl::Kernel::set_arg(m_kernels[KernelCullCompact], 4, sizeof(cl_mem), (void *) &m_buffers[BufferPointRadius]);
+
+        cl::Kernel::set_arg(m_kernels[KernelCullDrawArgs], 1, sizeof(cl_mem), (void *) &m_buffers[BufferCullOffsets]);
+    }
+
+    /* Neighbor lists */
+    if (m_neighbors) {
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCheck], 0, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborRebuild]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCheck], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCheck], 2, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborPos]);
+
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCount], 0, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborCounts]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCount], 1, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborRebuild]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCount], 2, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCount], 3, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborCount], 4, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 0, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborIndices]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 1, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborPos]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 2, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborOffsets]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 3, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborRebuild]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 4, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 5, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborFill], 6, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointVel]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 1, sizeof(cl_mem), (void *) &m_buffers[BufferPointPos]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 2, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborOffsets]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 3, sizeof(cl_mem), (void *) &m_buffers[BufferNeighborIndices]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 4, sizeof(cl_mem), (void *) &m_buffers[BufferHashmap]);
+        cl::Kernel::set_arg(m_kernels[KernelNeighborForces], 5, sizeof(cl_mem), (void *) &m_buffers[BufferKeys]);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::execute
+ * @brief Execute the model.
+ */
+void Model::execute(void)
+{
+    /* Update probe */
+    {
+        const math::vec3f domain_lo{
+            Params::domain_lo.s[0],
+            Params::domain_lo.s[1],
+            Params::domain_lo.s[2]};
+
+        const math::vec3f domain_hi{
+            Params::domain_hi.s[0],
+            Params::domain_hi.s[1],
+            Params::domain_hi.s[2]};
+
+        /* Headless runs use a fixed frame clock. */
+        const cl_float dt = 0.02f;
+        const cl_float time = m_headless
+            ? m_frame * Params::frame_time
+            : glfwGetTime();
+        const cl_float theta = dt * time;
+        const cl_float radius = std::cos(theta) * math::norm(domain_hi - domain_lo);
+
+        cl_float x = m_probe.pos.s[0];
+        cl_float y = m_probe.pos.s[1];
+
+        /* Update probe position and apply periodic boundary conditions. */
+        m_probe.pos.s[0] -= dt * radius * std::sin(theta);
+        m_probe.pos.s[1] += dt * radius * std::sin(theta);
+        m_probe.pos.s[2] += dt * radius * std::cos(theta);
+
+        for (size_t i = 0; i < 3; ++i) {
+            cl_float len = Params::domain_hi.s[i] - Params::domain_lo.s[i];
+            if (m_probe.pos.s[i] < Params::domain_lo.s[i]) {
+                m_probe.pos.s[i] += len;
+            } else if (m_probe.pos.s[i] > Params::domain_hi.s[i]) {
+                m_probe.pos.s[i] -= len;
+            }
+        }
+    }
+
+    /* Run the pipeline on the host with the cpu backend. */
+    if (Params::cpu_backend) {
+        execute_cpu();
+        m_frame++;
+        return;
+    }
+
+    /*
+     * Move the points over a time step with the velocities of the previous
+     * frame, compute their cell keys and clear the hashmap in a single pass.
+     * The invariant kernel arguments are bound once, in Model::bind_args.
+     */
+    {
+        static cl::NDRange global_ws(cl::NDRange::Roundup(
+            std::max(Params::n_sort, Params::capacity),
+            Params::work_group_size));
+        static cl::NDRange local_ws(Params::work_group_size);
+
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KerkelUpdatePoints],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageUpdatePoints));
+    }
+
+    /*
+     * Sort the (cell key, point id) pairs with a bitonic sort. Merge steps
+     * with a compare distance j smaller than the work-group size run in local
+     * memory in a single kernel.
+     */
+    {
+        static cl::NDRange global_ws(Params::n_sort);
+        static cl::NDRange local_ws(Params::work_group_size);
+
+        for (cl_uint k = 2; k <= Params::n_sort; k <<= 1) {
+            for (cl_uint j = k >> 1; j > 0; j >>= 1) {
+                cl_kernel kernel = (j < Params::work_group_size)
+                    ? m_kernels[KernelSortLocal]
+                    : m_kernels[KernelSortGlobal];
+
+                /* Set kernel arguments. */
+                cl::Kernel::set_arg(kernel, 1, sizeof(cl_uint), (void *) &k);
+                cl::Kernel::set_arg(kernel, 2, sizeof(cl_uint), (void *) &j);
+
+                /* Run the kernel */
+                cl::Queue::enqueue_nd_range_kernel(
+                    m_queue,
+                    kernel,
+                    cl::NDRange::Null,
+                    global_ws,
+                    local_ws,
+                    0,
+                    NULL,
+                    m_profiler.event(StageSort));
+
+                if (j < Params::work_group_size) {
+                    break;
+                }
+            }
+        }
+    }
+
+    /*
+     * Build the hashmap
+     */
+    {
+        /* Reset the hashmap stats counters. */
+        if (Params::diagnostics) {
+            static const Stats zero = {};
+            cl::Queue::enqueue_write_buffer(
+                m_queue,
+                m_buffers[BufferStats],
+                CL_FALSE,
+                0,
+                sizeof(Stats),
+                (void *) &zero);
+        }
 
         /* Run the kernel */
         static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
@@ -482,35 +1341,1227 @@ void Model::execute(void)
 
         cl::Queue::enqueue_nd_range_kernel(
             m_queue,
-            m_kernels[KerkelUpdatePoints],
+            m_kernels[KernelHashmapBuild],
             cl::NDRange::Null,
             global_ws,
-            local_ws);
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageHashmapBuild));
+
+        /* Read back the hashmap stats. */
+        if (Params::diagnostics) {
+            report_stats();
+        }
     }
 
     /*
-     * Update vertex data from the points positions
+     * Query the hashmap. Reset the points found by the previous query and
+     * mark the points found around the current probe position as they are
+     * stored.
      */
     {
-        /* Wait for OpenGL to finish and acquire the gl objects. */
-        cl::gl::enqueue_acquire_gl_objects(m_queue, 1, &m_buffers[BufferVertex]);
+        query_mark(m_query_size, 0);
+
+        /*
+         * Reorder the points along the Morton curve of their cells. The reset
+         * above still sees the previous point ids, and the query below sees
+         * the new ones.
+         */
+        if (Params::reorder_interval > 0 &&
+            m_frame % Params::reorder_interval == 0) {
+            reorder();
+        }
+
+        /*
+         * Fill the probe buffer with the probe as a pattern, which is copied
+         * when the command is enqueued, so the host does not wait for it.
+         */
+        cl_int err = clEnqueueFillBuffer(
+            m_queue,
+            m_buffers[BufferProbes],
+            &m_probe,
+            sizeof(Probe),
+            0,
+            sizeof(Probe),
+            0,
+            NULL,
+            m_profiler.event(StageQuery));
+        core_assert(err == CL_SUCCESS, "clEnqueueFillBuffer");
+        query(m_buffers[BufferProbes], 1, 1);
+    }
+
+    /*
+     * Update the neighbor lists, rebuilt on the first frame and after each
+     * reorder, which changes the point ids.
+     */
+    if (m_neighbors) {
+        neighbors(m_frame == 0 ||
+            (Params::reorder_interval > 0 &&
+             m_frame % Params::reorder_interval == 0));
+    }
 
-        /* Enqueue the OpenCL kernel for execution. */
-        cl::Kernel::set_arg(m_kernels[KerkelUpdateVertex], 0, sizeof(cl_mem),  (void *) &m_buffers[BufferVertex]);
-        cl::Kernel::set_arg(m_kernels[KerkelUpdateVertex], 1, sizeof(cl_mem),  (void *) &m_buffers[BufferPoints]);
-        cl::Kernel::set_arg(m_kernels[KerkelUpdateVertex], 2, sizeof(cl_uint), (void *) &Params::n_points);
+    /* Cross-check the query and the neighbor lists against the host. */
+    if (Params::check_interval > 0 &&
+        m_frame % Params::check_interval == 0) {
+        check();
+    }
 
+    /*
+     * Compute the pair forces with the neighbors in the neighbor lists, or
+     * found in the hashmap without them, and update the velocities. The
+     * points move at the start of the next frame.
+     */
+    {
         static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
         static cl::NDRange local_ws(Params::work_group_size);
 
         cl::Queue::enqueue_nd_range_kernel(
             m_queue,
-            m_kernels[KerkelUpdateVertex],
+            m_neighbors
+                ? m_kernels[KernelNeighborForces]
+                : m_kernels[KernelComputeForces],
             cl::NDRange::Null,
             global_ws,
-            local_ws);
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageComputeForces));
+    }
+
+    /* Snapshot the points for the trajectory every trajectory_interval frames. */
+    if (m_writer && m_frame % Params::trajectory_interval == 0) {
+        snapshot();
+    }
+
+    /*
+     * Write the frame into its vertex buffer set. With OpenGL sharing, copy
+     * the points and extract the surface into the shared buffers of the set.
+     * Otherwise, extract the surface into the device buffers when headless,
+     * or read the points back into the vertex buffers of the set.
+     */
+    const size_t set = m_frame % m_gl.n_sets;
+    if (m_interop) {
+        acquire_set(set);
+        if (m_surface) {
+            surface(m_shared[NumShared * set + SharedSurfaceVertices],
+                    m_shared[NumShared * set + SharedSurfaceDrawArgs]);
+        }
+        release_set(set);
+    } else {
+        if (m_surface) {
+            surface(m_buffers[BufferSurfaceVertices],
+                    m_buffers[BufferSurfaceDrawArgs]);
+        }
+        if (!m_headless) {
+            readback_points(set);
+        }
+    }
+
+    /* Collect the profiling samples of completed commands and report. */
+    if (m_profiler.enabled()) {
+        m_profiler.collect();
+        m_profiler.next_frame();
+        if (!m_headless && m_frame % Params::profile_interval == 0) {
+            std::cout << m_profiler.to_string();
+        }
+    }
+
+    m_frame++;
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::pack_points
+ * @brief Pack the host point data into the point vertices, as the
+ * pack_points kernel.
+ */
+void Model::pack_points(void)
+{
+    #pragma omp parallel for
+    for (size_t i = 0; i < Params::n_points; ++i) {
+        PointVertex &vertex = m_point_vertices[i];
+        for (size_t k = 0; k < 3; ++k) {
+            cl_float u = (m_point_pos[3 * i + k] - Params::domain_lo.s[k]) /
+                (Params::domain_hi.s[k] - Params::domain_lo.s[k]);
+            u = std::min(std::max(u, 0.0f), 1.0f);
+            vertex.pos[k] = (cl_ushort) std::lrint(65535.0f * u);
+        }
+        vertex.pos[3] = 257 * m_point_radius[i];
+        vertex.col = m_point_col[i];
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::execute_cpu
+ * @brief Execute the model stages on the host point data with the cpu
+ * backend. With OpenGL, upload the points to the vertex buffers.
+ */
+void Model::execute_cpu(void)
+{
+    CpuBackend &cpu = *m_cpu;
+
+    /* Move the points, then build the cell list and the hashmap. */
+    cpu.update_points(m_point_pos, m_point_vel);
+    cpu.build(m_point_pos);
+
+    /*
+     * Query the hashmap. Reset the points found by the previous query,
+     * reorder the points and mark the points found around the probe.
+     */
+    cpu.query_mark(m_point_col, m_point_radius, m_point_pos, 0);
+    if (Params::reorder_interval > 0 &&
+        m_frame % Params::reorder_interval == 0) {
+        cpu.reorder_points(m_point_pos, m_point_col, m_point_radius, m_point_vel);
+    }
+    cpu.query(m_point_pos, &m_probe, 1);
+    cpu.query_mark(m_point_col, m_point_radius, m_point_pos, 1);
+
+    /* Update the velocities, the points move at the start of the next frame. */
+    cpu.compute_forces(m_point_vel, m_point_pos);
+
+    /* Pack and upload the points to the vertex buffers. */
+    if (!m_headless) {
+        pack_points();
+        glBindBuffer(GL_ARRAY_BUFFER, m_gl.point_vbo[0]);
+        glBufferSubData(
+            GL_ARRAY_BUFFER,
+            0,
+            m_point_vertices.size() * sizeof(PointVertex),
+            m_point_vertices.data());
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::check
+ * @brief Cross-check the device query of the probe against the host
+ * pipeline on the same points, and report the hits found by only one of
+ * them. With neighbor lists, cross-check a sample of them against the host
+ * cell list. Blocks on the readback, so run it at a low rate.
+ */
+void Model::check(void)
+{
+    /* Read back the point positions and the query results. */
+    m_point_pos.resize(3 * Params::n_points);
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferPointPos],
+        CL_TRUE,
+        0,
+        3 * Params::n_points * sizeof(cl_float),
+        (void *) &m_point_pos[0]);
+
+    cl_uint offsets[2];
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferQueryOffsets],
+        CL_TRUE,
+        0,
+        2 * sizeof(cl_uint),
+        (void *) &offsets[0]);
+
+    std::vector<cl_uint> device(std::min(offsets[1], Params::max_hits));
+    if (!device.empty()) {
+        cl::Queue::enqueue_read_buffer(
+            m_queue,
+            m_buffers[BufferQueryIndices],
+            CL_TRUE,
+            0,
+            device.size() * sizeof(cl_uint),
+            (void *) &device[0]);
+    }
+
+    /* Query the probe on the host. */
+    m_cpu->build(m_point_pos);
+    m_cpu->query(m_point_pos, &m_probe, 1);
+    std::vector<cl_uint> host(
+        m_cpu->m_indices.begin(),
+        m_cpu->m_indices.begin() + std::min(m_cpu->m_offsets[1], Params::max_hits));
+
+    /* Compare the hit sets. */
+    std::sort(device.begin(), device.end());
+    std::sort(host.begin(), host.end());
+    std::vector<cl_uint> diff;
+    std::set_symmetric_difference(
+        device.begin(), device.end(),
+        host.begin(), host.end(),
+        std::back_inserter(diff));
+
+    std::cout << "check frame " << m_frame
+              << " hits device " << offsets[1]
+              << " host " << m_cpu->m_offsets[1]
+              << " mismatches " << diff.size() << "\n";
+
+    /*
+     * Compare the probe density. The sums run in a different order on the
+     * device, so they agree up to rounding.
+     */
+    cl_float density;
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferQueryDensity],
+        CL_TRUE,
+        0,
+        sizeof(cl_float),
+        (void *) &density);
+    const cl_float host_density = m_cpu->m_density[0];
+    const cl_float error = std::fabs(density - host_density) /
+        std::max(std::fabs(host_density), 1.0f);
+    std::cout << "check frame " << m_frame
+              << " density device " << density
+              << " host " << host_density
+              << " error " << error << "\n";
+
+    if (m_neighbors) {
+        check_neighbors();
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::check_neighbors
+ * @brief Cross-check the neighbor lists of a fixed random sample of points
+ * against a radius query of the host cell list, built by Model::check on the
+ * read back point positions. Every point within the cutoff must be listed,
+ * and every listed point must be within the cutoff plus twice the skin,
+ * since no point moved more than half the skin since the last build. Report
+ * the pairs missing from the lists and the stale listed points.
+ */
+void Model::check_neighbors(void)
+{
+    const cl_uint n_points = Params::n_points;
+    std::vector<cl_uint> offsets(n_points + 1);
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferNeighborOffsets],
+        CL_TRUE,
+        0,
+        offsets.size() * sizeof(cl_uint),
+        (void *) &offsets[0]);
+
+    /* Truncated lists are not used by the forces, so there is nothing to check. */
+    const cl_uint total = offsets[n_points];
+    if (total > Params::max_neighbors) {
+        std::cout << "check frame " << m_frame
+                  << " neighbors " << total
+                  << " overflow " << Params::max_neighbors << "\n";
+        return;
+    }
+
+    std::vector<cl_uint> indices(total);
+    if (!indices.empty()) {
+        cl::Queue::enqueue_read_buffer(
+            m_queue,
+            m_buffers[BufferNeighborIndices],
+            CL_TRUE,
+            0,
+            indices.size() * sizeof(cl_uint),
+            (void *) &indices[0]);
+    }
+
+    /* Draw the sample once, so every check visits the same point ids. */
+    if (m_neighbor_samples.empty()) {
+        std::mt19937 rng(Params::seed);
+        std::uniform_int_distribution<cl_uint> dist(0, n_points - 1);
+        m_neighbor_samples.resize(std::min(Params::neighbor_samples, n_points));
+        for (auto &it : m_neighbor_samples) {
+            it = dist(rng);
+        }
+    }
+
+    /* Minimum image squared distance between two points. */
+    const cl_float *p = m_point_pos.data();
+    cl_float length[3];
+    for (size_t k = 0; k < 3; ++k) {
+        length[k] = Params::domain_hi.s[k] - Params::domain_lo.s[k];
+    }
+    auto distance_sq = [p, &length] (const cl_uint i, const cl_uint j) {
+        cl_float r_sq = 0.0f;
+        for (size_t k = 0; k < 3; ++k) {
+            cl_float d = p[3*i + k] - p[3*j + k];
+            d -= length[k] * std::rint(d / length[k]);
+            r_sq += d * d;
+        }
+        return r_sq;
+    };
+
+    const cl_float range = Params::neighbor_cutoff + 2.0f * Params::neighbor_skin;
+    size_t missing = 0;
+    size_t stale = 0;
+    #pragma omp parallel for reduction(+:missing,stale) schedule(dynamic)
+    for (size_t s = 0; s < m_neighbor_samples.size(); ++s) {
+        const cl_uint i = m_neighbor_samples[s];
+        std::vector<cl_uint> list(
+            indices.begin() + offsets[i],
+            indices.begin() + offsets[i + 1]);
+        std::sort(list.begin(), list.end());
+        for (auto &j : list) {
+            if (distance_sq(i, j) > range * range) {
+                stale++;
+            }
+        }
+
+        const Probe probe = {{{p[3*i + 0], p[3*i + 1], p[3*i + 2]}}, Params::neighbor_cutoff};
+        std::vector<cl_uint> hits(m_cpu->query_probe(probe, m_point_pos, NULL, 0));
+        hits.resize(m_cpu->query_probe(probe, m_point_pos, hits.data(), 0));
+        for (auto &j : hits) {
+            if (j != i && !std::binary_search(list.begin(), list.end(), j)) {
+                missing++;
+            }
+        }
+    }
+
+    std::cout << "check frame " << m_frame
+              << " neighbors " << total
+              << " samples " << m_neighbor_samples.size()
+              << " missing " << missing
+              << " stale " << stale << "\n";
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::report_stats
+ * @brief Report the hashmap stats of every completed readback, then enqueue a
+ * non-blocking readback of the current stats into the next free host copy.
+ * Skip the readback if the host copy of this frame is still pending, so the
+ * diagnostics never stall the queue.
+ */
+void Model::report_stats(void)
+{
+    /* Report completed readbacks. */
+    for (auto &it : m_readbacks) {
+        if (it.event == NULL) {
+            continue;
+        }
+
+        cl_int status;
+        cl_int err = clGetEventInfo(
+            it.event,
+            CL_EVENT_COMMAND_EXECUTION_STATUS,
+            sizeof(cl_int),
+            &status,
+            NULL);
+        core_assert(err == CL_SUCCESS, "clGetEventInfo");
+        if (status != CL_COMPLETE) {
+            continue;
+        }
+        clReleaseEvent(it.event);
+        it.event = NULL;
+
+        const Stats &stats = it.stats;
+        double load = (double) stats.n_slots / Params::capacity;
+        double mean = stats.n_slots > 0
+            ? (double) stats.sum_probe / stats.n_slots
+            : 0.0;
 
-        /* Wait for OpenCL to finish and release the gl objects. */
-        cl::gl::enqueue_release_gl_objects(m_queue, 1, &m_buffers[BufferVertex]);
+        std::ostringstream ss;
+        ss << "frame "       << it.frame
+           << " slots "      << stats.n_slots << "/" << Params::capacity
+           << " load "       << load
+           << " collisions " << stats.n_collisions
+           << " probe mean " << mean
+           << " max "        << stats.max_probe
+           << " histogram";
+        for (size_t i = 0; i < Params::probe_bins; ++i) {
+            ss << " " << stats.histogram[i];
+        }
+        std::cout << ss.str() << "\n";
+    }
+
+    /* Enqueue the readback of the current stats. */
+    Readback &readback = m_readbacks[m_frame % m_readbacks.size()];
+    if (readback.event != NULL) {
+        return;
+    }
+    readback.frame = m_frame;
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferStats],
+        CL_FALSE,
+        0,
+        sizeof(Stats),
+        (void *) &readback.stats,
+        0,
+        NULL,
+        &readback.event);
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::reorder
+ * @brief Permute the point storage into the order of the sorted cell list.
+ * Any per-point device state must be gathered along with the points. The
+ * points are gathered into the swap buffers, which then take the place of
+ * the point buffers, and the kernel arguments are bound again.
+ */
+void Model::reorder(void)
+{
+    /* Run the kernel */
+    static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
+    static cl::NDRange local_ws(Params::work_group_size);
+
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelReorderPoints],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(StageReorder));
+
+    /* Swap the point buffers and bind them again. */
+    std::swap(m_buffers[BufferPointPos], m_buffers[BufferPointPosSwap]);
+    std::swap(m_buffers[BufferPointCol], m_buffers[BufferPointColSwap]);
+    std::swap(m_buffers[BufferPointRadius], m_buffers[BufferPointRadiusSwap]);
+    std::swap(m_buffers[BufferPointVel], m_buffers[BufferPointVelSwap]);
+    std::swap(m_buffers[BufferPointIds], m_buffers[BufferPointIdsSwap]);
+    bind_args();
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::neighbors
+ * @brief Update the neighbor lists of all points within the cutoff plus the
+ * skin, in CSR format, with the total number of neighbors in
+ * offsets[n_points]. Neighbors beyond Params::max_neighbors are dropped. The
+ * lists are rebuilt from the hashmap only if the host requires it or a point
+ * moved more than half the skin since the last build. The decision stays on
+ * the device: the rebuild kernels and the scan of the counts test the flag
+ * and return early, so most frames only run the displacement check, and the
+ * host never waits for it.
+ */
+void Model::neighbors(const bool rebuild)
+{
+    static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
+    static cl::NDRange local_ws(Params::work_group_size);
+
+    /*
+     * Set the rebuild flag if required, otherwise check the displacements.
+     */
+    if (rebuild) {
+        const cl_uint flag = 1;
+        cl_int err = clEnqueueFillBuffer(
+            m_queue,
+            m_buffers[BufferNeighborRebuild],
+            &flag,
+            sizeof(flag),
+            0,
+            sizeof(flag),
+            0,
+            NULL,
+            m_profiler.event(StageNeighbors));
+        core_assert(err == CL_SUCCESS, "clEnqueueFillBuffer");
+    } else {
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelNeighborCheck],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageNeighbors));
+    }
+
+    /*
+     * Count the neighbors of each point and scan the counts into the CSR
+     * offsets.
+     */
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelNeighborCount],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(StageNeighbors));
+    scan(m_buffers[BufferNeighborOffsets],
+         m_buffers[BufferNeighborCounts],
+         Params::n_points,
+         StageNeighbors,
+         m_buffers[BufferNeighborRebuild]);
+
+    /*
+     * Store the neighbors of each point in the CSR indices and clear the
+     * rebuild flag.
+     */
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelNeighborFill],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(StageNeighbors));
+
+    const cl_uint flag = 0;
+    cl_int err = clEnqueueFillBuffer(
+        m_queue,
+        m_buffers[BufferNeighborRebuild],
+        &flag,
+        sizeof(flag),
+        0,
+        sizeof(flag),
+        0,
+        NULL,
+        m_profiler.event(StageNeighbors));
+    core_assert(err == CL_SUCCESS, "clEnqueueFillBuffer");
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::snapshot
+ * @brief Read the point positions and original ids of the frame into a free
+ * pinned snapshot without blocking, and hand it to the trajectory writer
+ * with the event of the read. The queue is in order, so the event of the
+ * ids read completes after the positions read. The frame waits only if
+ * every snapshot is still pending in the writer.
+ */
+void Model::snapshot(void)
+{
+    const size_t slot = m_writer->acquire();
+    const Snapshot &snapshot = m_snapshots[slot];
+
+    cl_event event;
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferPointPos],
+        CL_FALSE,
+        0,
+        3 * Params::n_points * sizeof(cl_float),
+        (void *) snapshot.pos_ptr,
+        0,
+        NULL,
+        m_profiler.event(StageSnapshot));
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferPointIds],
+        CL_FALSE,
+        0,
+        Params::n_points * sizeof(cl_uint),
+        (void *) snapshot.ids_ptr,
+        0,
+        NULL,
+        &event);
+    clFlush(m_queue);
+    m_writer->submit(slot, m_frame, event);
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::query
+ * @brief Batched radius query of n_probes probes in a device buffer.
+ * Count the points found by each probe, scan the counts into the CSR offsets
+ * and store the point ids in the CSR indices, with the total number of hits
+ * in offsets[n_probes]. Hits beyond Params::max_hits are dropped. If mark is
+ * set, color the stored points in the same pass. Then reduce the distance
+ * weights of the stored hits of each probe into its density.
+ */
+void Model::query(const cl_mem &probes, const cl_uint n_probes, const cl_uint mark)
+{
+    core_assert(n_probes <= Params::max_probes, "probe count overflow");
+    m_query_size = n_probes;
+    if (n_probes == 0) {
+        return;
+    }
+
+    cl::NDRange global_ws(cl::NDRange::Roundup(n_probes, Params::work_group_size));
+    cl::NDRange local_ws(Params::work_group_size);
+
+    /*
+     * Count the hits of each probe.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelQueryCount], 1, sizeof(cl_mem),  (void *) &probes);
+        cl::Kernel::set_arg(m_kernels[KernelQueryCount], 2, sizeof(cl_uint), (void *) &n_probes);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelQueryCount],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageQuery));
+    }
+
+    /*
+     * Scan the counts into the CSR offsets.
+     */
+    scan(m_buffers[BufferQueryOffsets], m_buffers[BufferQueryCounts], n_probes, StageQuery);
+
+    /*
+     * Store the hits of each probe in the CSR indices, and mark them.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelQueryFill], 2, sizeof(cl_mem),  (void *) &probes);
+        cl::Kernel::set_arg(m_kernels[KernelQueryFill], 3, sizeof(cl_uint), (void *) &n_probes);
+        cl::Kernel::set_arg(m_kernels[KernelQueryFill], 9, sizeof(cl_uint), (void *) &mark);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelQueryFill],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageQuery));
+    }
+
+    /*
+     * Weight the hits of each probe by their distance and sum the weights
+     * of each probe into its density.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 4, sizeof(cl_mem),  (void *) &probes);
+        cl::Kernel::set_arg(m_kernels[KernelQueryWeights], 5, sizeof(cl_uint), (void *) &n_probes);
+
+        /* Run the kernel, one work-group per probe */
+        cl::NDRange group_ws(n_probes * Params::work_group_size);
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelQueryWeights],
+            cl::NDRange::Null,
+            group_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageQuery));
+    }
+
+    segment_sum(
+        m_buffers[BufferQueryDensity],
+        m_buffers[BufferQueryWeights],
+        m_buffers[BufferQueryOffsets],
+        n_probes,
+        Params::max_hits,
+        StageQuery);
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::query_mark
+ * @brief Color the points found by the last query if mark is set, otherwise
+ * reset their color. Run one work-group per probe.
+ */
+void Model::query_mark(const cl_uint n_probes, const cl_uint mark)
+{
+    if (n_probes == 0) {
+        return;
+    }
+
+    /* Set kernel arguments. */
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 5, sizeof(cl_uint), (void *) &n_probes);
+    cl::Kernel::set_arg(m_kernels[KernelQueryMark], 6, sizeof(cl_uint), (void *) &mark);
+
+    /* Run the kernel */
+    cl::NDRange global_ws(n_probes * Params::work_group_size);
+    cl::NDRange local_ws(Params::work_group_size);
+
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelQueryMark],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(StageQuery));
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::scan
+ * @brief Exclusive prefix sum of n values into out, with the total in out[n],
+ * profiled in the given stage. Scan each block of 2 * work_group_size values,
+ * then scan the block totals at the next level and add them back to each
+ * block. The input may be the output buffer. If enable is not null, the
+ * kernels run only if the device flag in enable is set.
+ */
+void Model::scan(
+    const cl_mem &out,
+    const cl_mem &in,
+    const cl_uint n,
+    const size_t stage,
+    const cl_mem &enable,
+    const size_t level)
+{
+    core_assert(n > 0, "empty scan");
+    core_assert(level < m_scan_sums.size(), "scan size overflow");
+
+    const cl_uint block = 2 * Params::work_group_size;
+    const cl_uint n_blocks = (n + block - 1) / block;
+    cl::NDRange global_ws(n_blocks * Params::work_group_size);
+    cl::NDRange local_ws(Params::work_group_size);
+
+    /*
+     * Scan each block and store the block totals.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelScanBlocks], 0, sizeof(cl_mem),  (void *) &out);
+        cl::Kernel::set_arg(m_kernels[KernelScanBlocks], 1, sizeof(cl_mem),  (void *) &m_scan_sums[level]);
+        cl::Kernel::set_arg(m_kernels[KernelScanBlocks], 2, sizeof(cl_mem),  (void *) &in);
+        cl::Kernel::set_arg(m_kernels[KernelScanBlocks], 3, sizeof(cl_uint), (void *) &n);
+        cl::Kernel::set_arg(m_kernels[KernelScanBlocks], 4, sizeof(cl_mem),  (void *) &enable);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelScanBlocks],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(stage));
+    }
+
+    if (n_blocks == 1) {
+        return;
+    }
+
+    /*
+     * Scan the block totals in place and add them to each block.
+     */
+    scan(m_scan_sums[level], m_scan_sums[level], n_blocks, stage, enable, level + 1);
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelScanAdd], 0, sizeof(cl_mem),  (void *) &out);
+        cl::Kernel::set_arg(m_kernels[KernelScanAdd], 1, sizeof(cl_mem),  (void *) &m_scan_sums[level]);
+        cl::Kernel::set_arg(m_kernels[KernelScanAdd], 2, sizeof(cl_uint), (void *) &n);
+        cl::Kernel::set_arg(m_kernels[KernelScanAdd], 3, sizeof(cl_mem),  (void *) &enable);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelScanAdd],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(stage));
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::compact
+ * @brief Stream compaction of n flags, 0 or 1. Scan the flags into offsets
+ * and list the flagged indices in order, with their count in offsets[n] on
+ * the device. The offsets hold n + 1 values.
+ */
+void Model::compact(
+    const cl_mem &indices,
+    const cl_mem &offsets,
+    const cl_mem &flags,
+    const cl_uint n,
+    const size_t stage)
+{
+    scan(offsets, flags, n, stage);
+
+    /* Set kernel arguments. */
+    cl::Kernel::set_arg(m_kernels[KernelCompactIndices], 0, sizeof(cl_mem),  (void *) &indices);
+    cl::Kernel::set_arg(m_kernels[KernelCompactIndices], 1, sizeof(cl_mem),  (void *) &offsets);
+    cl::Kernel::set_arg(m_kernels[KernelCompactIndices], 2, sizeof(cl_uint), (void *) &n);
+
+    /* Run the kernel */
+    cl::NDRange global_ws(cl::NDRange::Roundup(n, Params::work_group_size));
+    cl::NDRange local_ws(Params::work_group_size);
+
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelCompactIndices],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(stage));
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::segment_sum
+ * @brief Segmented reduction of the float values over the CSR segments
+ * [offsets[s], offsets[s+1]), clamped to n_values, into out[s]. Run one
+ * work-group per segment.
+ */
+void Model::segment_sum(
+    const cl_mem &out,
+    const cl_mem &values,
+    const cl_mem &offsets,
+    const cl_uint n_segments,
+    const cl_uint n_values,
+    const size_t stage)
+{
+    if (n_segments == 0) {
+        return;
+    }
+
+    /* Set kernel arguments. */
+    cl::Kernel::set_arg(m_kernels[KernelSegmentSum], 0, sizeof(cl_mem),  (void *) &out);
+    cl::Kernel::set_arg(m_kernels[KernelSegmentSum], 1, sizeof(cl_mem),  (void *) &values);
+    cl::Kernel::set_arg(m_kernels[KernelSegmentSum], 2, sizeof(cl_mem),  (void *) &offsets);
+    cl::Kernel::set_arg(m_kernels[KernelSegmentSum], 3, sizeof(cl_uint), (void *) &n_segments);
+    cl::Kernel::set_arg(m_kernels[KernelSegmentSum], 4, sizeof(cl_uint), (void *) &n_values);
+
+    /* Run the kernel */
+    cl::NDRange global_ws(n_segments * Params::work_group_size);
+    cl::NDRange local_ws(Params::work_group_size);
+
+    cl::Queue::enqueue_nd_range_kernel(
+        m_queue,
+        m_kernels[KernelSegmentSum],
+        cl::NDRange::Null,
+        global_ws,
+        local_ws,
+        0,
+        NULL,
+        m_profiler.event(stage));
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::surface
+ * @brief Extract the iso-surface of the point density with marching cubes.
+ * Splat the point density on the grid nodes, classify the voxels, scan their
+ * vertex counts and occupied flags, compact the active voxels and generate
+ * their triangles into the vertex buffer. The vertex count is written into
+ * the indirect draw arguments on the device, so nothing is read back.
+ */
+void Model::surface(const cl_mem &vertices, const cl_mem &args)
+{
+    static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_voxels, Params::work_group_size));
+    static cl::NDRange local_ws(Params::work_group_size);
+
+    /* Set the vertex buffers of the frame. */
+    cl::Kernel::set_arg(m_kernels[KernelSurfaceGenerate], 0, sizeof(cl_mem), (void *) &vertices);
+    cl::Kernel::set_arg(m_kernels[KernelSurfaceDrawArgs], 0, sizeof(cl_mem), (void *) &args);
+
+    /*
+     * Splat the point density on the grid nodes.
+     */
+    {
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelSurfaceDensity],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageSurface));
+    }
+
+    /*
+     * Classify the voxels and scan their vertex counts.
+     */
+    {
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelSurfaceClassify],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageSurface));
+
+        scan(m_buffers[BufferSurfaceVertexOffsets],
+             m_buffers[BufferSurfaceCounts],
+             Params::n_voxels,
+             StageSurface);
+    }
+
+    /*
+     * Compact the active voxels and generate their triangles.
+     */
+    {
+        compact(m_buffers[BufferSurfaceActive],
+                m_buffers[BufferSurfaceOccupiedOffsets],
+                m_buffers[BufferSurfaceOccupied],
+                Params::n_voxels,
+                StageSurface);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelSurfaceGenerate],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageSurface));
+    }
+
+    /*
+     * Write the indirect draw arguments.
+     */
+    {
+        /* Run the kernel in a single work-item */
+        static cl::NDRange single_ws(1);
+
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelSurfaceDrawArgs],
+            cl::NDRange::Null,
+            single_ws,
+            single_ws,
+            0,
+            NULL,
+            m_profiler.event(StageSurface));
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::cull
+ * @brief Cull the point sprites outside the view frustum of the camera.
+ * Flag the visible points, scan the flags and compact the visible points
+ * into the shared vertex buffers of the set, with their count written into
+ * the indirect draw arguments, so the vertex work scales with the visible
+ * points. The set is drawn in the next frame, so the frustum is widened by
+ * the cull margin to cover the camera motion in between.
+ */
+void Model::cull(const size_t set)
+{
+    static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
+    static cl::NDRange local_ws(Params::work_group_size);
+
+    /*
+     * Flag the visible points and scan the flags.
+     */
+    {
+        const math::mat4f m = m_gl.camera.persp() * m_gl.camera.view();
+        cl_float16 view_persp;
+        for (size_t i = 0; i < 16; ++i) {
+            view_persp.s[i] = m.data()[i];
+        }
+        const cl_float scale = m_gl.point_scale;
+
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 4, sizeof(cl_float16), (void *) &view_persp);
+        cl::Kernel::set_arg(m_kernels[KernelCullPoints], 5, sizeof(cl_float),   (void *) &scale);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelCullPoints],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageCull));
+
+        scan(m_buffers[BufferCullOffsets],
+             m_buffers[BufferCullFlags],
+             Params::n_points,
+             StageCull);
+    }
+
+    /*
+     * Compact the visible points into the vertex buffers.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelCullCompact], 0, sizeof(cl_mem), (void *) &m_shared[NumShared * set + SharedPointVertices]);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelCullCompact],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageVertices));
+    }
+
+    /*
+     * Write the indirect draw arguments.
+     */
+    {
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelCullDrawArgs], 0, sizeof(cl_mem), (void *) &m_shared[NumShared * set + SharedPointDrawArgs]);
+
+        /* Run the kernel in a single work-item */
+        static cl::NDRange single_ws(1);
+
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelCullDrawArgs],
+            cl::NDRange::Null,
+            single_ws,
+            single_ws,
+            0,
+            NULL,
+            m_profiler.event(StageCull));
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::acquire_set
+ * @brief Acquire the shared vertex buffers of the set, once OpenGL is done
+ * drawing them. With cl_khr_gl_event, the acquire waits on the device for
+ * an event created from the draw fence. Otherwise, the host waits for the
+ * fence before the acquire.
+ */
+void Model::acquire_set(const size_t set)
+{
+    cl_event event = NULL;
+    GLsync fence = m_gl.fences[set];
+    if (fence != NULL) {
+        if (m_gl_event) {
+            cl_int err;
+            event = clCreateEventFromGLsyncKHR(m_context, (cl_GLsync) fence, &err);
+            core_assert(err == CL_SUCCESS, "clCreateEventFromGLsyncKHR");
+        } else {
+            GLenum status;
+            do {
+                status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+            } while (status == GL_TIMEOUT_EXPIRED);
+            core_assert(status != GL_WAIT_FAILED, "glClientWaitSync");
+        }
+    }
+
+    /* The point and surface buffers of the set are contiguous. */
+    cl::gl::enqueue_acquire_gl_objects(
+        m_queue,
+        m_surface ? NumShared : SharedSurfaceVertices,
+        &m_shared[NumShared * set],
+        event != NULL ? 1 : 0,
+        event != NULL ? &event : NULL,
+        m_profiler.event(StageAcquire));
+    if (event != NULL) {
+        clReleaseEvent(event);
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::release_set
+ * @brief Pack the points into the shared vertex buffers of the set, or only
+ * the visible points with frustum culling, and release them to OpenGL.
+ * Mark the end of the release and submit the commands, so the frame runs
+ * on the device while OpenGL draws.
+ */
+void Model::release_set(const size_t set)
+{
+    if (m_cull) {
+        cull(set);
+    } else {
+        static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
+        static cl::NDRange local_ws(Params::work_group_size);
+
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelPackPoints], 0, sizeof(cl_mem), (void *) &m_shared[NumShared * set + SharedPointVertices]);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelPackPoints],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageVertices));
+    }
+
+    cl::gl::enqueue_release_gl_objects(
+        m_queue,
+        m_surface ? NumShared : SharedSurfaceVertices,
+        &m_shared[NumShared * set],
+        0,
+        NULL,
+        m_profiler.event(StageRelease));
+
+    cl_int err = clEnqueueMarkerWithWaitList(m_queue, 0, NULL, &m_set_events[set]);
+    core_assert(err == CL_SUCCESS, "clEnqueueMarkerWithWaitList");
+    clFlush(m_queue);
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::readback_points
+ * @brief Pack the points on the device and read them back into the vertex
+ * buffer of the set, without OpenGL sharing. The vertex buffer is mapped
+ * for writing and filled by a non-blocking read, which overlaps the draw of
+ * the other sets.
+ */
+void Model::readback_points(const size_t set)
+{
+    wait_set(set);
+
+    /* Pack the points. */
+    {
+        static cl::NDRange global_ws(cl::NDRange::Roundup(Params::n_points, Params::work_group_size));
+        static cl::NDRange local_ws(Params::work_group_size);
+
+        /* Set kernel arguments. */
+        cl::Kernel::set_arg(m_kernels[KernelPackPoints], 0, sizeof(cl_mem), (void *) &m_buffers[BufferPointVertices]);
+
+        /* Run the kernel */
+        cl::Queue::enqueue_nd_range_kernel(
+            m_queue,
+            m_kernels[KernelPackPoints],
+            cl::NDRange::Null,
+            global_ws,
+            local_ws,
+            0,
+            NULL,
+            m_profiler.event(StageVertices));
+    }
+
+    /* Read the packed points into the mapped vertex buffer. */
+    const size_t size = Params::n_points * sizeof(PointVertex);
+    glBindBuffer(GL_ARRAY_BUFFER, m_gl.point_vbo[set]);
+    void *ptr = glMapBufferRange(
+        GL_ARRAY_BUFFER,
+        0,
+        size,
+        GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+    core_assert(ptr != NULL, "glMapBufferRange");
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    cl::Queue::enqueue_read_buffer(
+        m_queue,
+        m_buffers[BufferPointVertices],
+        CL_FALSE,
+        0,
+        size,
+        ptr,
+        0,
+        NULL,
+        m_profiler.event(StageVertices));
+
+    /* Mark the end of the readback and submit the commands. */
+    cl_int err = clEnqueueMarkerWithWaitList(m_queue, 0, NULL, &m_set_events[set]);
+    core_assert(err == CL_SUCCESS, "clEnqueueMarkerWithWaitList");
+    clFlush(m_queue);
+}
+
+/** ---------------------------------------------------------------------------
+ * Model::wait_set
+ * @brief Wait for OpenCL to finish writing the vertex buffer set, if it is
+ * pending, so it can be drawn. Without OpenGL sharing, unmap its vertex
+ * buffer.
+ */
+void Model::wait_set(const size_t set)
+{
+    if (m_set_events[set] == NULL) {
+        return;
+    }
+    clWaitForEvents(1, &m_set_events[set]);
+    clReleaseEvent(m_set_events[set]);
+    m_set_events[set] = NULL;
+
+    if (!m_interop) {
+        glBindBuffer(GL_ARRAY_BUFFER, m_gl.point_vbo[set]);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
     }
 }
@@ -12,77 +12,266 @@
 #ifndef MODEL_H_
 #define MODEL_H_
 
+#include <memory>
 #include <vector>
 #include "base.hpp"
 #include "camera.hpp"
+#include "device.hpp"
+#include "profiler.hpp"
+
+struct CpuBackend;
+struct PointFile;
+struct TrajectoryWriter;
 
 struct Model : atto::gl::Drawable {
     /* ---- Model data ---------------------------------------------- */
-    struct Point {
+    struct KeyValue {
+        cl_ulong key;
+        cl_uint value;
+    };
+
+    struct Cell {
+        cl_ulong key;
+        cl_uint start;
+        cl_uint end;
+    };
+
+    struct Stats {
+        cl_uint n_slots;
+        cl_uint n_collisions;
+        cl_uint max_probe;
+        cl_uint sum_probe;
+        cl_uint histogram[Params::probe_bins];
+    };
+
+    struct Readback {
+        Stats stats;
+        cl_ulong frame;
+        cl_event event;
+    };
+
+    struct Probe {
         cl_float3 pos;
-        cl_float3 col;
         cl_float radius;
     };
 
-    struct KeyValue {
-        cl_uint key;
-        cl_uint value;
+    struct Snapshot {
+        cl_mem pos;                             /* pinned, mapped once */
+        cl_mem ids;
+        cl_float *pos_ptr;
+        cl_uint *ids_ptr;
+    };
+
+    struct DrawArgs {
+        cl_uint count;
+        cl_uint instance_count;
+        cl_uint first;
+        cl_uint base_instance;
+    };
+    struct PointVertex {
+        cl_ushort pos[4];                       /* unorm16 xyz in the domain, radius */
+        cl_uchar4 col;                          /* RGBA8 */
     };
 
-    std::vector<Point> m_points;
-    Point m_probe;
+    /* Point data in structure-of-arrays layout */
+    std::vector<cl_float> m_point_pos;          /* x, y, z */
+    std::vector<cl_uchar4> m_point_col;         /* RGBA8 */
+    std::vector<cl_uchar> m_point_radius;       /* unorm8 */
+    std::vector<cl_float> m_point_vel;          /* vx, vy, vz */
+    std::vector<PointVertex> m_point_vertices;  /* packed for drawing */
+    Probe m_probe;
+    cl_uint m_query_size = 0;
+    cl_ulong m_frame = 0;
+    std::vector<Readback> m_readbacks;
+    std::unique_ptr<CpuBackend> m_cpu;          /* host pipeline and reference */
+    std::unique_ptr<PointFile> m_file;          /* mapped point file */
+    std::vector<Snapshot> m_snapshots;
+    std::unique_ptr<TrajectoryWriter> m_writer; /* trajectory output thread */
 
     /* ---- Model OpenCL data ---------------------------------------------- */
     cl_context m_context = NULL;
     cl_device_id m_device = NULL;
     cl_command_queue m_queue = NULL;
     cl_program m_program = NULL;
+    bool m_interop = false;                     /* OpenGL sharing */
+    bool m_gl_event = false;                    /* cl_khr_gl_event */
+    bool m_surface = false;                     /* surface extraction */
+    bool m_cull = false;                        /* frustum culling */
+    bool m_neighbors = false;                   /* neighbor lists */
+    std::vector<cl_uint> m_neighbor_samples;    /* point ids of the neighbor check */
+    cl_event m_set_events[Params::max_pipeline_depth] = {};    /* write of each set */
     enum {
-        KernelHashmapClear = 0,
+        KernelSortGlobal = 0,
+        KernelSortLocal,
         KernelHashmapBuild,
-        KernelHashmapQuery,
+        KernelRandomPoints,
+        KernelPointIds,
+        KernelReorderPoints,
+        KernelQueryCount,
+        KernelQueryFill,
+        KernelQueryMark,
+        KernelQueryWeights,
+        KernelScanBlocks,
+        KernelScanAdd,
+        KernelCompactIndices,
+        KernelSegmentSum,
+        KernelComputeForces,
         KerkelUpdatePoints,
-        KerkelUpdateVertex,
+        KernelSurfaceDensity,
+        KernelSurfaceClassify,
+        KernelSurfaceGenerate,
+        KernelSurfaceDrawArgs,
+        KernelPackPoints,
+        KernelCullPoints,
+        KernelCullCompact,
+        KernelCullDrawArgs,
+        KernelNeighborCheck,
+        KernelNeighborCount,
+        KernelNeighborFill,
+        KernelNeighborForces,
         NumKernels
     };
     std::vector<cl_kernel> m_kernels;
     enum {
         BufferHashmap = 0,
-        BufferPoints,
-        BufferVertex,
+        BufferKeys,
+        BufferStats,
+        BufferPointPos,
+        BufferPointCol,
+        BufferPointRadius,
+        BufferPointPosSwap,
+        BufferPointColSwap,
+        BufferPointRadiusSwap,
+        BufferPointVel,
+        BufferPointVelSwap,
+        BufferPointIds,
+        BufferPointIdsSwap,
+        BufferProbes,
+        BufferQueryCounts,
+        BufferQueryOffsets,
+        BufferQueryIndices,
+        BufferQueryWeights,
+        BufferQueryDensity,
+        BufferSurfaceDensity,
+        BufferSurfaceCounts,
+        BufferSurfaceOccupied,
+        BufferSurfaceVertexOffsets,
+        BufferSurfaceOccupiedOffsets,
+        BufferSurfaceActive,
+        BufferSurfaceVertices,
+        BufferSurfaceDrawArgs,
+        BufferPointVertices,
+        BufferCullFlags,
+        BufferCullOffsets,
+        BufferNeighborRebuild,
+        BufferNeighborPos,
+        BufferNeighborCounts,
+        BufferNeighborOffsets,
+        BufferNeighborIndices,
         NumBuffers
     };
     std::vector<cl_mem> m_buffers;
+    std::vector<cl_mem> m_scan_sums;            /* block totals of each scan level */
+    enum {
+        SharedPointVertices = 0,
+        SharedPointDrawArgs,
+        SharedSurfaceVertices,
+        SharedSurfaceDrawArgs,
+        NumShared
+    };
+    std::vector<cl_mem> m_shared;               /* OpenGL buffers of each set */
     enum {
         NumImages = 0
     };
     std::vector<cl_mem> m_images;
 
+    /* ---- Model profiling data ------------------------------------------- */
+    bool m_headless = false;
+    enum {
+        StageAcquire = 0,
+        StageUpdatePoints,
+        StageSort,
+        StageHashmapBuild,
+        StageReorder,
+        StageQuery,
+        StageComputeForces,
+        StageSurface,
+        StageCull,
+        StageRelease,
+        StageVertices,
+        StageSnapshot,
+        StageNeighbors,
+        NumStages
+    };
+    Profiler m_profiler;
+
     /* ---- Model OpenGL data ---------------------------------------------- */
     struct GLData {
         Camera camera;
+        bool draw_indirect = false;             /* GL 4.0 or ARB_draw_indirect */
 
-        /* point data */
+        /* packed point vertices, one set of buffers per frame in flight */
         GLfloat point_scale = 0.02f;
-        GLuint point_vbo;
-
-        /* sprite data */
-        std::vector<GLfloat> sprite_vertex;
-        std::vector<GLuint> sprite_index;
-        GLuint sprite_vbo;
-        GLuint sprite_ebo;
+        size_t n_sets = 1;
+        GLuint point_vbo[Params::max_pipeline_depth];
+        GLuint point_args[Params::max_pipeline_depth];  /* visible instances */
+        GLsync fences[Params::max_pipeline_depth] = {};  /* draw of each set */
 
         /* shader program */
         GLuint program;
-        GLuint vao;
+        GLuint vao[Params::max_pipeline_depth];
+
+        /* surface data, interleaved position and normal, drawn indirectly */
+        GLuint surface_vbo[Params::max_pipeline_depth];
+        GLuint surface_args[Params::max_pipeline_depth];
+        GLuint surface_program;
+        GLuint surface_vao[Params::max_pipeline_depth];
     } m_gl;
 
     /* ---- Model member functions ----------------------------------------- */
     void handle(const atto::gl::Event &event) override;
     void draw(void *data = nullptr) override;
+    void bind_args(void);
+    void load_points(void);
     void execute(void);
+    void execute_cpu(void);
+    void check(void);
+    void check_neighbors(void);
+    void reorder(void);
+    void neighbors(const bool rebuild);
+    void snapshot(void);
+    void report_stats(void);
+    void query(const cl_mem &probes, const cl_uint n_probes, const cl_uint mark);
+    void query_mark(const cl_uint n_probes, const cl_uint mark);
+    void scan(
+        const cl_mem &out,
+        const cl_mem &in,
+        const cl_uint n,
+        const size_t stage,
+        const cl_mem &enable = NULL,
+        const size_t level = 0);
+    void compact(
+        const cl_mem &indices,
+        const cl_mem &offsets,
+        const cl_mem &flags,
+        const cl_uint n,
+        const size_t stage);
+    void segment_sum(
+        const cl_mem &out,
+        const cl_mem &values,
+        const cl_mem &offsets,
+        const cl_uint n_segments,
+        const cl_uint n_values,
+        const size_t stage);
+    void surface(const cl_mem &vertices, const cl_mem &args);
+    void pack_points(void);
+    void cull(const size_t set);
+    void acquire_set(const size_t set);
+    void release_set(const size_t set);
+    void readback_points(const size_t set);
+    void wait_set(const size_t set);
 
-    Model();
+    explicit Model(const DeviceQuery &query, bool headless = false);
     ~Model();
     Model(const Model &) = delete;
     Model &operator=(const Model &) = delete;
@@ -0,0 +1,331 @@
+/*
+ * params.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <limits>
+#include "base.hpp"
+#include "loader.hpp"
+using namespace atto;
+
+namespace Params {
+/* Model parameters, default values */
+cl_uint n_points = 16384;
+cl_uint n_cells = 32;
+cl_uint load_factor = 4;
+cl_float3 domain_lo = {-1.0f, -1.0f, -1.0f};
+cl_float3 domain_hi = { 1.0f,  1.0f,  1.0f};
+std::string points_file;
+cl_uint seed = 1;
+
+/* Dynamics parameters, default values */
+cl_float time_step = 1.0e-3f;
+cl_float stiffness = 1.0e4f;
+cl_float diameter = 0.05f;
+
+/* Surface parameters, default values */
+cl_uint surface_grid = 64;
+cl_float surface_radius = 0.06f;
+cl_float surface_iso = 0.3f;
+
+/* Neighbor list parameters, default values */
+cl_float neighbor_cutoff = 0.0f;
+cl_float neighbor_skin = 0.01f;
+
+/* OpenCL parameters, default values */
+cl_ulong work_group_size = 256;
+
+/* OpenGL parameters, default values */
+cl_uint pipeline_depth = 2;
+
+/* Backend parameters, default values */
+bool cpu_backend = false;
+cl_uint check_interval = 0;
+
+/* Trajectory parameters, default values */
+std::string trajectory_file;
+cl_uint trajectory_interval = 10;
+bool trajectory_quantize = false;
+
+/* Derived parameters */
+cl_uint capacity = 0;
+cl_uint max_hits = 0;
+cl_uint n_sort = 0;
+cl_uint n_voxels = 0;
+cl_uint max_vertices = 0;
+cl_uint max_neighbors = 0;
+
+/**
+ * parse_uint
+ * Parse an unsigned integer, throwing std::out_of_range if it does not fit
+ * in a cl_uint. A negative value wraps around in std::stoul and is rejected.
+ */
+static cl_uint parse_uint(const std::string &value)
+{
+    unsigned long v = std::stoul(value);
+    if (v > std::numeric_limits<cl_uint>::max()) {
+        throw std::out_of_range("parse_uint");
+    }
+    return static_cast<cl_uint>(v);
+}
+
+/**
+ * parse_float3
+ * Parse a comma separated float triplet.
+ */
+static cl_float3 parse_float3(const std::string &value)
+{
+    cl_float3 v = {};
+    std::istringstream ss(value);
+    std::string item;
+    for (size_t i = 0; i < 3; ++i) {
+        if (!std::getline(ss, item, ',')) {
+            throw std::invalid_argument("parse_float3");
+        }
+        v.s[i] = std::stof(item);
+    }
+    return v;
+}
+
+/**
+ * set_value
+ * Set a parameter from its name and value string. Invalid numbers throw
+ * the std::stoul and std::stof exceptions.
+ */
+static bool set_value(const std::string &name, const std::string &value)
+{
+    if (name == "n_points") {
+        n_points = parse_uint(value);
+    } else if (name == "n_cells") {
+        n_cells = parse_uint(value);
+    } else if (name == "load_factor") {
+        load_factor = parse_uint(value);
+    } else if (name == "domain_lo") {
+        domain_lo = parse_float3(value);
+    } else if (name == "domain_hi") {
+        domain_hi = parse_float3(value);
+    } else if (name == "points_file") {
+        points_file = value;
+    } else if (name == "seed") {
+        seed = parse_uint(value);
+    } else if (name == "time_step") {
+        time_step = std::stof(value);
+    } else if (name == "stiffness") {
+        stiffness = std::stof(value);
+    } else if (name == "diameter") {
+        diameter = std::stof(value);
+    } else if (name == "surface_grid") {
+        surface_grid = parse_uint(value);
+    } else if (name == "surface_radius") {
+        surface_radius = std::stof(value);
+    } else if (name == "surface_iso") {
+        surface_iso = std::stof(value);
+    } else if (name == "neighbor_cutoff") {
+        neighbor_cutoff = std::stof(value);
+    } else if (name == "neighbor_skin") {
+        neighbor_skin = std::stof(value);
+    } else if (name == "work_group_size") {
+        work_group_size = std::stoull(value);
+    } else if (name == "pipeline_depth") {
+        pipeline_depth = parse_uint(value);
+    } else if (name == "backend") {
+        core_assert(value == "cpu" || value == "opencl", "unknown backend");
+        cpu_backend = (value == "cpu");
+    } else if (name == "check_interval") {
+        check_interval = parse_uint(value);
+    } else if (name == "trajectory_file") {
+        trajectory_file = value;
+    } else if (name == "trajectory_interval") {
+        trajectory_interval = parse_uint(value);
+    } else if (name == "trajectory_format") {
+        core_assert(value == "float" || value == "unorm16", "unknown trajectory format");
+        trajectory_quantize = (value == "unorm16");
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * Params::set
+ * Set a parameter from its name and value string, and abort with the name
+ * of the parameter if its value is invalid.
+ */
+bool set(const std::string &name, const std::string &value)
+{
+    try {
+        return set_value(name, value);
+    } catch (const std::logic_error &) {
+        std::cerr << "invalid value '" << value << "' of parameter " << name << "\n";
+        core_assert(false, "invalid parameter value");
+    }
+    return false;
+}
+
+/**
+ * Params::load
+ * Set the parameters in a config file.
+ */
+void load(const std::string &filename)
+{
+    std::ifstream file(filename);
+    core_assert(file.is_open(), "failed to open config file");
+
+    std::string line;
+    while (std::getline(file, line)) {
+        line = line.substr(0, line.find('#'));
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            core_assert(line.find_first_not_of(" \t\r") == std::string::npos,
+                "invalid config line");
+            continue;
+        }
+
+        /* Strip the blanks around the name and the value. The value is the
+         * rest of the line, it may hold blanks, e.g. -1, -1, -1. */
+        std::string name, value = line.substr(eq + 1);
+        std::istringstream(line.substr(0, eq)) >> name;
+        size_t first = value.find_first_not_of(" \t\r");
+        size_t last = value.find_last_not_of(" \t\r");
+        value = first == std::string::npos ? "" : value.substr(first, last - first + 1);
+        bool known = set(name, value);
+        core_assert(known, "unknown config parameter");
+    }
+}
+
+/**
+ * Params::update
+ * Check the parameters and compute the derived parameters.
+ */
+void update(void)
+{
+    /* The number of points of a point file is given by its header. */
+    if (!points_file.empty()) {
+        PointFile file(points_file);
+        core_assert(file.m_count <= std::numeric_limits<cl_uint>::max(),
+            "too many points in the point file");
+        n_points = file.m_count;
+    }
+
+    core_assert(n_points > 0, "invalid number of points");
+    core_assert(n_cells > 0 && n_cells <= max_cells, "invalid number of cells");
+    core_assert(load_factor > 0, "invalid load factor");
+    core_assert(work_group_size > 0 &&
+        next_pow2(work_group_size) == work_group_size,
+        "work-group size must be a power of two");
+    core_assert(pipeline_depth > 0 && pipeline_depth <= max_pipeline_depth,
+        "invalid pipeline depth");
+    for (size_t i = 0; i < 3; ++i) {
+        core_assert(domain_lo.s[i] < domain_hi.s[i], "invalid domain");
+    }
+
+    /* Neighbors are searched in the 27 cells around each point. */
+    core_assert(n_cells >= 3, "dynamics need at least 3 cells");
+    for (size_t i = 0; i < 3; ++i) {
+        core_assert(diameter <= (domain_hi.s[i] - domain_lo.s[i]) / n_cells,
+            "sphere diameter above the cell width");
+    }
+
+    /* Surface densities are gathered in the 27 cells around each node. */
+    if (surface_grid > 0) {
+        core_assert(surface_grid >= 2 && surface_grid <= max_surface_grid,
+            "invalid surface grid");
+        core_assert(surface_iso > 0.0f, "invalid surface iso-value");
+        for (size_t i = 0; i < 3; ++i) {
+            core_assert(surface_radius > 0.0f &&
+                surface_radius <= (domain_hi.s[i] - domain_lo.s[i]) / n_cells,
+                "surface radius above the cell width");
+        }
+    }
+
+    /* Neighbor lists are gathered in the 27 cells around each point. */
+    if (neighbor_cutoff > 0.0f) {
+        core_assert(!cpu_backend, "the cpu backend does not build neighbor lists");
+        core_assert(neighbor_skin >= 0.0f, "invalid neighbor skin");
+        core_assert(neighbor_cutoff >= diameter,
+            "neighbor cutoff below the sphere diameter");
+        for (size_t i = 0; i < 3; ++i) {
+            core_assert(neighbor_cutoff + neighbor_skin <=
+                (domain_hi.s[i] - domain_lo.s[i]) / n_cells,
+                "neighbor cutoff plus skin above the cell width");
+        }
+        core_assert(n_points <= std::numeric_limits<cl_uint>::max() / neighbor_capacity,
+            "too many points for the neighbor lists");
+    }
+
+    core_assert(!(cpu_backend && check_interval > 0),
+        "the cpu backend has no device results to check");
+    if (!trajectory_file.empty()) {
+        core_assert(!cpu_backend, "the cpu backend does not write trajectories");
+        core_assert(trajectory_interval > 0, "invalid trajectory interval");
+    }
+
+    /* The sizes are computed in 64-bit and must fit in a cl_uint, with the
+     * capacity at most 2^31 so its next power of two does not wrap around.
+     * This also bounds the number of points, and so the sort size. */
+    const cl_ulong max_uint = std::numeric_limits<cl_uint>::max();
+    const cl_ulong n_slots = (cl_ulong) load_factor * n_points;
+    const cl_ulong n_hits = (cl_ulong) 16 * n_points;
+    core_assert(n_slots <= max_uint / 2 + 1, "hashmap capacity above the cl_uint range");
+    core_assert(n_hits <= max_uint, "maximum number of hits above the cl_uint range");
+
+    capacity = next_pow2((cl_uint) n_slots);
+    max_hits = (cl_uint) n_hits;
+    n_sort = std::max(next_pow2(n_points), (cl_uint) work_group_size);
+    n_voxels = surface_grid * surface_grid * surface_grid;
+    max_vertices = 3 * n_voxels;
+    max_neighbors = neighbor_cutoff > 0.0f ? neighbor_capacity * n_points : 0;
+}
+
+/**
+ * Params::build_options
+ * Define the parameters as kernel constants. Floats are printed with enough
+ * digits to round trip. The surface and neighbor list constants are defined
+ * only if they are enabled.
+ */
+std::string build_options(void)
+{
+    std::ostringstream ss;
+    ss << std::scientific << std::setprecision(9);
+    ss << "-DN_POINTS=" << n_points << "u"
+       << " -DN_SORT=" << n_sort << "u"
+       << " -DN_CELLS=" << n_cells << "u"
+       << " -DCAPACITY=" << capacity << "u"
+       << " -DMAX_HITS=" << max_hits << "u"
+       << " -DWORK_GROUP_SIZE=" << work_group_size
+       << " -DDOMAIN_LO=(float3)("
+       << domain_lo.s[0] << "f,"
+       << domain_lo.s[1] << "f,"
+       << domain_lo.s[2] << "f)"
+       << " -DDOMAIN_HI=(float3)("
+       << domain_hi.s[0] << "f,"
+       << domain_hi.s[1] << "f,"
+       << domain_hi.s[2] << "f)"
+       << " -DTIME_STEP=" << time_step << "f"
+       << " -DSTIFFNESS=" << stiffness << "f"
+       << " -DDIAMETER=" << diameter << "f";
+    if (surface_grid > 0) {
+        ss << " -DSURFACE_GRID=" << surface_grid << "u"
+           << " -DSURFACE_RADIUS=" << surface_radius << "f"
+           << " -DSURFACE_ISO=" << surface_iso << "f"
+           << " -DMAX_VERTICES=" << max_vertices << "u";
+    }
+    if (neighbor_cutoff > 0.0f) {
+        ss << " -DNEIGHBOR_CUTOFF=" << neighbor_cutoff << "f"
+           << " -DNEIGHBOR_SKIN=" << neighbor_skin << "f"
+           << " -DMAX_NEIGHBORS=" << max_neighbors << "u";
+    }
+    return ss.str();
+}
+} /* Params */
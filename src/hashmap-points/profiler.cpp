@@ -0,0 +1,219 @@
+/*
+ * profiler.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <algorithm>
+#include <array>
+#include <iomanip>
+#include <sstream>
+#include "profiler.hpp"
+using namespace atto;
+
+/**
+ * Profiler::Profiler
+ * Create a profiler with a ring buffer of capacity samples per stage.
+ */
+Profiler::Profiler(
+    const std::vector<std::string> &names,
+    const size_t capacity,
+    const bool enabled)
+    : m_enabled(enabled)
+    , m_names(names)
+    , m_samples(names.size(), std::vector<Sample>(capacity))
+    , m_count(names.size(), 0)
+    , m_totals(names.size(), Sample{0, 0, 0, 0})
+{}
+
+/**
+ * Profiler::~Profiler
+ * Release the events of the pending commands.
+ */
+Profiler::~Profiler()
+{
+    for (auto &it : m_pending) {
+        if (it.event != NULL) {
+            clReleaseEvent(it.event);
+        }
+    }
+}
+
+/**
+ * Profiler::event
+ * Return the event slot of a command enqueued in the stage. The slot stays
+ * valid until the next call to collect.
+ */
+cl_event *Profiler::event(const size_t stage)
+{
+    if (!m_enabled) {
+        return NULL;
+    }
+    core_assert(stage < m_names.size(), "stage overflow");
+    m_pending.push_back({stage, m_frame, NULL});
+    return &m_pending.back().event;
+}
+
+/**
+ * Profiler::flush
+ * Store the stage sums of the collected frame in the ring buffers, for the
+ * stages that enqueued commands in the frame, and reset the sums.
+ */
+void Profiler::flush(void)
+{
+    for (size_t stage = 0; stage < m_names.size(); ++stage) {
+        Sample &total = m_totals[stage];
+        if (total.commands == 0) {
+            continue;
+        }
+        std::vector<Sample> &samples = m_samples[stage];
+        samples[m_count[stage] % samples.size()] = total;
+        m_count[stage]++;
+        total = Sample{0, 0, 0, 0};
+    }
+}
+
+/**
+ * Profiler::collect
+ * Collect the samples of the pending commands in enqueue order, stopping at
+ * the first command that is not complete, unless wait is set. Commands are
+ * collected in enqueue order, so the first command of a later frame
+ * completes the sums of the collected frame.
+ */
+void Profiler::collect(const bool wait)
+{
+    while (!m_pending.empty()) {
+        Pending &pending = m_pending.front();
+        if (pending.event == NULL) {
+            m_pending.pop_front();
+            continue;
+        }
+
+        if (wait) {
+            clWaitForEvents(1, &pending.event);
+        } else {
+            cl_int status;
+            cl_int err = clGetEventInfo(
+                pending.event,
+                CL_EVENT_COMMAND_EXECUTION_STATUS,
+                sizeof(cl_int),
+                &status,
+                NULL);
+            core_assert(err == CL_SUCCESS, "clGetEventInfo");
+            if (status != CL_COMPLETE) {
+                break;
+            }
+        }
+
+        const cl_profiling_info params[] = {
+            CL_PROFILING_COMMAND_QUEUED,
+            CL_PROFILING_COMMAND_SUBMIT,
+            CL_PROFILING_COMMAND_START,
+            CL_PROFILING_COMMAND_END};
+        cl_ulong times[4];
+        for (size_t i = 0; i < 4; ++i) {
+            cl_int err = clGetEventProfilingInfo(
+                pending.event,
+                params[i],
+                sizeof(cl_ulong),
+                &times[i],
+                NULL);
+            core_assert(err == CL_SUCCESS, "clGetEventProfilingInfo");
+        }
+        clReleaseEvent(pending.event);
+        const cl_ulong queued = times[0];
+        const cl_ulong submit = std::max(times[1], queued);
+        const cl_ulong start = std::max(times[2], submit);
+        const cl_ulong end = std::max(times[3], start);
+
+        if (pending.frame != m_collect_frame) {
+            flush();
+            m_collect_frame = pending.frame;
+        }
+        Sample &total = m_totals[pending.stage];
+        total.exec += end - start;
+        total.submit = std::max(total.submit, submit - queued);
+        total.wait = std::max(total.wait, start - submit);
+        total.commands++;
+        m_pending.pop_front();
+    }
+
+    /* Every command was collected, so the last frame is complete. */
+    if (wait) {
+        flush();
+    }
+}
+
+/**
+ * Profiler::to_string
+ * Rolling min, mean and p99 over the frames of the stage execution time, the
+ * sum of start to end of its commands, of the longest submit time, queued to
+ * submit, and of the longest wait time, submit to start, of its commands, in
+ * microseconds, with the mean number of commands per frame.
+ */
+std::string Profiler::to_string(void) const
+{
+    /* Compute the min, mean and p99 of a set of durations. */
+    auto stats = [] (std::vector<double> &v) -> std::array<double,3> {
+        std::sort(v.begin(), v.end());
+        double sum = 0.0;
+        for (auto &it : v) {
+            sum += it;
+        }
+        size_t p99 = (99 * v.size() + 99) / 100 - 1;
+        return {v.front(), sum / v.size(), v[p99]};
+    };
+
+    /* Format the min, mean and p99 of a set of durations. */
+    auto format = [] (const std::array<double,3> &v) -> std::string {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(1)
+           << v[0] << "/" << v[1] << "/" << v[2];
+        return ss.str();
+    };
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    ss << std::setw(16) << "stage"
+       << std::setw(10) << "frames"
+       << std::setw(10) << "cmds"
+       << std::setw(30) << "exec/frame min/mean/p99 (us)"
+       << std::setw(30) << "submit max min/mean/p99 (us)"
+       << std::setw(30) << "wait max min/mean/p99 (us)" << "\n";
+
+    for (size_t stage = 0; stage < m_names.size(); ++stage) {
+        size_t n = std::min(m_count[stage], m_samples[stage].size());
+        if (n == 0) {
+            continue;
+        }
+
+        std::vector<double> exec(n);
+        std::vector<double> submit(n);
+        std::vector<double> wait(n);
+        double commands = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            const Sample &sample = m_samples[stage][i];
+            exec[i] = 1.0e-3 * sample.exec;
+            submit[i] = 1.0e-3 * sample.submit;
+            wait[i] = 1.0e-3 * sample.wait;
+            commands += sample.commands;
+        }
+        std::array<double,3> e = stats(exec);
+        std::array<double,3> s = stats(submit);
+        std::array<double,3> w = stats(wait);
+
+        ss << std::setw(16) << m_names[stage]
+           << std::setw(10) << m_count[stage]
+           << std::setw(10) << commands / n
+           << std::setw(30) << format(e)
+           << std::setw(30) << format(s)
+           << std::setw(30) << format(w) << "\n";
+    }
+
+    return ss.str();
+}
@@ -0,0 +1,86 @@
+/*
+ * profiler.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <deque>
+#include <string>
+#include <vector>
+#include "atto/opencl/opencl.hpp"
+
+/**
+ * Profiler
+ * OpenCL event profiler. Commands enqueued in a stage hand their event to
+ * the profiler, tagged with the current frame. The profiler collects the
+ * times of completed commands and sums them per stage and frame, so a stage
+ * of many launches, like the sort, yields one sample per frame. The frame
+ * samples are kept in a ring buffer per stage.
+ */
+struct Profiler {
+    /* Profiling times of a stage over a frame, in nanoseconds. */
+    struct Sample {
+        cl_ulong exec;                          /* sum of start to end */
+        cl_ulong submit;                        /* max of queued to submit */
+        cl_ulong wait;                          /* max of submit to start */
+        cl_uint commands;
+    };
+
+    /* Event of a command not yet collected. */
+    struct Pending {
+        size_t stage;
+        size_t frame;
+        cl_event event;
+    };
+
+    bool m_enabled;
+    std::vector<std::string> m_names;
+    std::vector<std::vector<Sample>> m_samples;
+    std::vector<size_t> m_count;
+    std::deque<Pending> m_pending;
+    size_t m_frame = 0;                         /* frame of enqueued commands */
+    size_t m_collect_frame = 0;                 /* frame of collected commands */
+    std::vector<Sample> m_totals;               /* stage sums of m_collect_frame */
+
+    /* Is the profiler enabled? */
+    bool enabled(void) const { return m_enabled; }
+
+    /* Return the event slot of a command enqueued in the stage, or null if
+     * the profiler is disabled. */
+    cl_event *event(const size_t stage);
+
+    /* Start the next frame of enqueued commands. */
+    void next_frame(void) { m_frame++; }
+
+    /* Collect the samples of completed commands, or of all pending commands
+     * if wait is set. */
+    void collect(const bool wait = false);
+
+    /* Store the stage sums of the collected frame in the ring buffers. */
+    void flush(void);
+
+    /* Rolling min, mean and p99 of the stage frame samples. Submit is the
+     * host side queueing, wait is the device side wait for the command. */
+    std::string to_string(void) const;
+
+    /* Constructor/destructor. */
+    Profiler(
+        const std::vector<std::string> &names,
+        const size_t capacity,
+        const bool enabled);
+    ~Profiler();
+
+    /* Copy constructor/assignment */
+    Profiler(const Profiler &) = delete;
+    Profiler &operator=(const Profiler &) = delete;
+}; /* Profiler */
+
+#endif /* PROFILER_H_ */
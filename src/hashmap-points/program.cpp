@@ -0,0 +1,247 @@
+/*
+ * program.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "base.hpp"
+#include "program.hpp"
+using namespace atto;
+
+/**
+ * fnv1a
+ * Hash the string into the 64-bit FNV-1a hash.
+ */
+static cl_ulong fnv1a(const std::string &str, cl_ulong h = 0xcbf29ce484222325UL)
+{
+    for (auto &c : str) {
+        h ^= (cl_uchar) c;
+        h *= 0x100000001b3UL;
+    }
+    return h;
+}
+
+/**
+ * get_device_string
+ * Return a device info string parameter.
+ */
+static std::string get_device_string(
+    const cl_device_id &device,
+    const cl_device_info param)
+{
+    size_t size = 0;
+    cl_int err = clGetDeviceInfo(device, param, 0, NULL, &size);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    std::string str(size, '\0');
+    err = clGetDeviceInfo(device, param, size, &str[0], NULL);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    return str.c_str();
+}
+
+/**
+ * get_platform_version
+ * Return the version of the device platform.
+ */
+static std::string get_platform_version(const cl_device_id &device)
+{
+    cl_platform_id platform = NULL;
+    cl_int err = clGetDeviceInfo(device, CL_DEVICE_PLATFORM, sizeof(platform), &platform, NULL);
+    core_assert(err == CL_SUCCESS, "clGetDeviceInfo");
+    size_t size = 0;
+    err = clGetPlatformInfo(platform, CL_PLATFORM_VERSION, 0, NULL, &size);
+    core_assert(err == CL_SUCCESS, "clGetPlatformInfo");
+    std::string version(size, '\0');
+    err = clGetPlatformInfo(platform, CL_PLATFORM_VERSION, size, &version[0], NULL);
+    core_assert(err == CL_SUCCESS, "clGetPlatformInfo");
+    return version.c_str();
+}
+
+/**
+ * cache_filename
+ * Return the cache file of the program binary. Each part of the key is
+ * hashed with its terminating null, so the parts cannot run into each other.
+ */
+static std::string cache_filename(
+    const cl_device_id &device,
+    const std::string &source,
+    const std::string &options,
+    const std::string &cache_dir)
+{
+    const std::string key[] = {
+        source,
+        options,
+        get_device_string(device, CL_DEVICE_NAME),
+        get_device_string(device, CL_DEVICE_VERSION),
+        get_device_string(device, CL_DRIVER_VERSION),
+        get_platform_version(device)};
+
+    cl_ulong h = fnv1a("");
+    for (auto &it : key) {
+        h = fnv1a(it + '\0', h);
+    }
+
+    std::ostringstream ss;
+    ss << cache_dir << "/" << std::hex;
+    ss.width(16);
+    ss.fill('0');
+    ss << h << ".bin";
+    return ss.str();
+}
+
+/**
+ * load_binary
+ * Create the program from the cached binary and build it, or return NULL if
+ * the binary is missing or the device rejects it.
+ */
+static cl_program load_binary(
+    const cl_context &context,
+    const cl_device_id &device,
+    const std::string &options,
+    const std::string &filename)
+{
+    std::ifstream file(filename, std::ios::binary);
+    if (!file.is_open()) {
+        return NULL;
+    }
+    std::vector<cl_uchar> binary(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    if (binary.empty()) {
+        return NULL;
+    }
+
+    const size_t size = binary.size();
+    const cl_uchar *data = binary.data();
+    cl_int status = CL_SUCCESS;
+    cl_int err = CL_SUCCESS;
+    cl_program program = clCreateProgramWithBinary(
+        context, 1, &device, &size, &data, &status, &err);
+    if (err != CL_SUCCESS || status != CL_SUCCESS) {
+        if (program != NULL) {
+            clReleaseProgram(program);
+        }
+        return NULL;
+    }
+
+    err = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+    if (err != CL_SUCCESS) {
+        clReleaseProgram(program);
+        return NULL;
+    }
+    return program;
+}
+
+/**
+ * store_binary
+ * Store the binary of the built program in the cache. The binary is written
+ * to a temporary file and renamed, so concurrent runs never read a partial
+ * binary. Failures leave the cache unchanged.
+ */
+static void store_binary(
+    const cl_program &program,
+    const std::string &cache_dir,
+    const std::string &filename)
+{
+    size_t size = 0;
+    cl_int err = clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size), &size, NULL);
+    if (err != CL_SUCCESS || size == 0) {
+        return;
+    }
+    std::vector<cl_uchar> binary(size);
+    cl_uchar *data = binary.data();
+    err = clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(data), &data, NULL);
+    if (err != CL_SUCCESS) {
+        return;
+    }
+
+    mkdir(cache_dir.c_str(), 0755);
+    std::string tmpname = filename + "." + std::to_string(getpid());
+    {
+        std::ofstream file(tmpname, std::ios::binary);
+        if (!file.write((const char *) data, size)) {
+            file.close();
+            std::remove(tmpname.c_str());
+            return;
+        }
+    }
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        std::remove(tmpname.c_str());
+    }
+}
+
+/**
+ * build_source
+ * Build the program from its source, or print the build options and the
+ * build log and abort if the build fails.
+ */
+static void build_source(
+    const cl_program &program,
+    const cl_device_id &device,
+    const std::string &options)
+{
+    cl_int err = clBuildProgram(program, 1, &device, options.c_str(), NULL, NULL);
+    if (err == CL_SUCCESS) {
+        return;
+    }
+
+    size_t size = 0;
+    std::string log;
+    if (clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, 0, NULL, &size) == CL_SUCCESS) {
+        log.resize(size, '\0');
+        clGetProgramBuildInfo(program, device, CL_PROGRAM_BUILD_LOG, size, &log[0], NULL);
+    }
+    std::cerr << "build options " << options << "\n"
+              << log.c_str() << "\n";
+    core_assert(false, "clBuildProgram");
+}
+
+/**
+ * build_program
+ * Load the program binary from the cache, or build the program from its
+ * source and store its binary in the cache.
+ */
+cl_program build_program(
+    const cl_context &context,
+    const cl_device_id &device,
+    const std::string &filename,
+    const std::string &options,
+    const std::string &cache_dir)
+{
+    std::ifstream file(filename);
+    core_assert(file.is_open(), "failed to open program source");
+    std::string source(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+
+    std::string binary_file;
+    if (!cache_dir.empty()) {
+        binary_file = cache_filename(device, source, options, cache_dir);
+        cl_program program = load_binary(context, device, options, binary_file);
+        if (program != NULL) {
+            if (Params::diagnostics) {
+                std::cout << "program binary " << binary_file << "\n";
+            }
+            return program;
+        }
+    }
+
+    cl_program program = cl::Program::create_from_source(context, source);
+    build_source(program, device, options);
+    if (!cache_dir.empty()) {
+        store_binary(program, cache_dir, binary_file);
+    }
+    return program;
+}
@@ -0,0 +1,30 @@
+/*
+ * program.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef PROGRAM_H_
+#define PROGRAM_H_
+
+#include <string>
+#include "atto/opencl/opencl.hpp"
+
+/* Create the program of the source file and build it for the device with
+ * the options. The built binary is kept in the program cache directory,
+ * keyed by a hash of the source, the options, and the device, driver and
+ * platform versions, and loaded instead of the source on later runs. An
+ * empty cache directory disables the cache. */
+cl_program build_program(
+    const cl_context &context,
+    const cl_device_id &device,
+    const std::string &filename,
+    const std::string &options,
+    const std::string &cache_dir);
+
+#endif /* PROGRAM_H_ */
@@ -0,0 +1,161 @@
+/*
+ * writer.cpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include "base.hpp"
+#include "writer.hpp"
+using namespace atto;
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::TrajectoryWriter
+ * @brief Open the trajectory file, write its header and start the writer
+ * thread. Every slot starts free.
+ */
+TrajectoryWriter::TrajectoryWriter(
+    const std::string &filename,
+    const std::vector<Slot> &slots,
+    const bool quantize)
+    : m_quantize(quantize)
+    , m_slots(slots)
+{
+    m_file = std::fopen(filename.c_str(), "wb");
+    core_assert(m_file != nullptr, "failed to open trajectory file");
+
+    char magic[8] = "HPTRAJ1";
+    cl_uint header[2] = {Params::n_points, m_quantize ? 1u : 0u};
+    bool ok = std::fwrite(magic, sizeof(magic), 1, m_file) == 1 &&
+              std::fwrite(header, sizeof(header), 1, m_file) == 1 &&
+              std::fwrite(Params::domain_lo.s, 3 * sizeof(cl_float), 1, m_file) == 1 &&
+              std::fwrite(Params::domain_hi.s, 3 * sizeof(cl_float), 1, m_file) == 1;
+    core_assert(ok, "failed to write trajectory header");
+
+    m_pos.resize(3 * Params::n_points);
+    if (m_quantize) {
+        m_quantized.resize(3 * Params::n_points);
+    }
+    for (size_t slot = 0; slot < m_slots.size(); ++slot) {
+        m_free.push_back(slot);
+    }
+    m_thread = std::thread(&TrajectoryWriter::run, this);
+}
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::~TrajectoryWriter
+ * @brief Write the pending frames, stop the writer thread and close the
+ * trajectory file.
+ */
+TrajectoryWriter::~TrajectoryWriter()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_done = true;
+    }
+    m_cond.notify_all();
+    m_thread.join();
+    std::fclose(m_file);
+}
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::acquire
+ * @brief Take a free slot. If the writer falls behind, wait for it rather
+ * than drop the frame, so the trajectory is complete.
+ */
+size_t TrajectoryWriter::acquire(void)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_cond.wait(lock, [this] { return !m_free.empty(); });
+    size_t slot = m_free.front();
+    m_free.pop_front();
+    return slot;
+}
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::submit
+ * @brief Submit the slot of the frame to the writer thread, which takes
+ * ownership of the read event.
+ */
+void TrajectoryWriter::submit(const size_t slot, const cl_ulong frame, cl_event event)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back({slot, frame});
+        m_events.push_back(event);
+    }
+    m_cond.notify_all();
+}
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::run
+ * @brief Writer thread loop. Wait for the read of each pending slot, write
+ * its frame and free the slot, until the writer is done and nothing is
+ * pending.
+ */
+void TrajectoryWriter::run(void)
+{
+    for (;;) {
+        std::pair<size_t, cl_ulong> pending;
+        cl_event event;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this] { return m_done || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+            pending = m_pending.front();
+            event = m_events.front();
+            m_pending.pop_front();
+            m_events.pop_front();
+        }
+
+        clWaitForEvents(1, &event);
+        clReleaseEvent(event);
+        write_frame(pending.first, pending.second);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(pending.first);
+        }
+        m_cond.notify_all();
+    }
+}
+
+/** ---------------------------------------------------------------------------
+ * TrajectoryWriter::write_frame
+ * @brief Scatter the slot positions back into the original point order,
+ * quantize them if required, and append the frame.
+ */
+void TrajectoryWriter::write_frame(const size_t slot, const cl_ulong frame)
+{
+    const Slot &it = m_slots[slot];
+    for (size_t i = 0; i < Params::n_points; ++i) {
+        const size_t id = it.ids[i];
+        m_pos[3 * id + 0] = it.pos[3 * i + 0];
+        m_pos[3 * id + 1] = it.pos[3 * i + 1];
+        m_pos[3 * id + 2] = it.pos[3 * i + 2];
+    }
+
+    const cl_ulong number = frame;
+    bool ok = std::fwrite(&number, sizeof(number), 1, m_file) == 1;
+    if (m_quantize) {
+        for (size_t i = 0; i < m_pos.size(); ++i) {
+            const size_t k = i % 3;
+            cl_float u = (m_pos[i] - Params::domain_lo.s[k]) /
+                (Params::domain_hi.s[k] - Params::domain_lo.s[k]);
+            u = std::min(std::max(u, 0.0f), 1.0f);
+            m_quantized[i] = (cl_ushort) std::lrint(65535.0f * u);
+        }
+        ok = ok && std::fwrite(m_quantized.data(), sizeof(cl_ushort), m_quantized.size(), m_file) == m_quantized.size();
+    } else {
+        ok = ok && std::fwrite(m_pos.data(), sizeof(cl_float), m_pos.size(), m_file) == m_pos.size();
+    }
+    core_assert(ok, "failed to write trajectory frame");
+}
@@ -0,0 +1,82 @@
+/*
+ * writer.hpp
+ *
+ * Copyright (c) 2020 Carlos Braga
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the MIT License.
+ *
+ * See accompanying LICENSE.md or https://opensource.org/licenses/MIT.
+ */
+
+#ifndef WRITER_H_
+#define WRITER_H_
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "atto/opencl/opencl.hpp"
+
+/**
+ * TrajectoryWriter
+ * Background writer of point position snapshots. The model reads each
+ * snapshot into a free slot, a pinned host buffer, without blocking, and
+ * submits it with the event of the read. The writer thread waits for the
+ * event, restores the original point order from the point ids, and appends
+ * the frame to the file, before freeing the slot.
+ *
+ * The file starts with a header:
+ *  char     magic[8]       "HPTRAJ1"
+ *  uint32   n_points
+ *  uint32   format         0 float xyz, 1 unorm16 xyz in the domain
+ *  float    domain_lo[3]
+ *  float    domain_hi[3]
+ * followed by the frames, each a uint64 frame number and the n_points xyz
+ * triplets in the original point order.
+ */
+struct TrajectoryWriter {
+    struct Slot {
+        const cl_float *pos;                    /* xyz in storage order */
+        const cl_uint *ids;                     /* original id of each point */
+    };
+
+    std::FILE *m_file = nullptr;
+    bool m_quantize = false;
+    std::vector<Slot> m_slots;
+    std::vector<cl_float> m_pos;                /* xyz in the original order */
+    std::vector<cl_ushort> m_quantized;         /* unorm16 xyz */
+
+    /* Slot queues, shared with the writer thread */
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    std::deque<size_t> m_free;
+    std::deque<std::pair<size_t, cl_ulong>> m_pending;
+    std::deque<cl_event> m_events;
+    bool m_done = false;
+    std::thread m_thread;
+
+    /* Take a free slot, waiting for the writer if every slot is pending. */
+    size_t acquire(void);
+
+    /* Submit the slot of the frame, read when the event completes. */
+    void submit(const size_t slot, const cl_ulong frame, cl_event event);
+
+    /* Writer thread loop and frame output. */
+    void run(void);
+    void write_frame(const size_t slot, const cl_ulong frame);
+
+    TrajectoryWriter(
+        const std::string &filename,
+        const std::vector<Slot> &slots,
+        const bool quantize);
+    ~TrajectoryWriter();
+
+    TrajectoryWriter(const TrajectoryWriter &) = delete;
+    TrajectoryWriter &operator=(const TrajectoryWriter &) = delete;
+};
+
+#endif /* WRITER_H_ */